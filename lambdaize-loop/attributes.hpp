@@ -0,0 +1,25 @@
+/**
+ * @file attributes.hpp
+ * @brief lambdaize-loop パスが生成した関数に付ける関数属性の名前
+ * @details count-cyclomatic-complexity などがパスの生成した関数を名前によらず見分けられるよう、ここで共有する
+ */
+
+#include <llvm/ADT/StringRef.h>
+
+namespace lambdaize_attributes {
+    /**
+     * @brief extracted 関数に付ける関数属性の名前
+     */
+    constexpr llvm::StringLiteral ExtractedAttribute = "lambdaize-extracted";
+
+    /**
+     * @brief 合成した looper 関数（とそれが呼び出す再帰用の関数）に付ける関数属性の名前
+     */
+    constexpr llvm::StringLiteral LooperAttribute = "lambdaize-looper";
+
+    /**
+     * @brief 一度の呼び出しで複数回繰り返す extracted 関数に付ける関数属性の名前
+     * @details 値は一度の呼び出しで行う繰り返しの回数（-lambdaize-batch の値）である
+     */
+    constexpr llvm::StringLiteral BatchAttribute = "lambdaize-batch";
+}
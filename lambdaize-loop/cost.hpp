@@ -0,0 +1,52 @@
+/**
+ * @file cost.hpp
+ * @brief 難読化によって増える実行コストの見積もり
+ * @details lambdaize-loop パスと count-cyclomatic-complexity が同じ見積もりを使うよう、ここで共有する
+ * @note 単位はおおよそ命令数である
+ */
+
+#include <llvm/ADT/StringRef.h>
+#include <algorithm>
+
+namespace lambdaize_cost {
+    /**
+     * @brief looper 関数を経由して extracted 関数を一回呼び出すコストを見積もる
+     * @param Looper looper 関数の種類（-lambdaize-looper に指定する名前）
+     * @param VaList 変数を va_list で渡すか
+     * @return 見積もられたコスト
+     */
+    inline double getLooperCost(llvm::StringRef Looper, bool VaList)
+    {
+        // 間接呼び出しやクロージャの呼び出しを伴う runtime が最も重く、
+        // 呼び出し先が定数になる合成された looper 関数はそれよりも軽い
+        double Cost = Looper == "while" ? 4. : Looper == "recursive" ? 6. : Looper == "tailrec" ? 5. : 12.;
+
+        // va_list 渡しの場合は呼び出しのたびに va_copy と va_end が行われる
+        return VaList ? Cost + 4. : Cost;
+    }
+
+    /**
+     * @brief 変数を一つ extracted 関数に渡すコストを見積もる
+     * @param VaList 変数を va_list で渡すか
+     * @return 見積もられたコスト
+     */
+    inline double getCaptureCost(bool VaList)
+    {
+        // va_arg はレジスタ保存領域とスタック上の領域のどちらから取り出すかの分岐を伴う
+        return VaList ? 6. : 1.;
+    }
+
+    /**
+     * @brief 繰り返し一回あたりに増えるコストを見積もる
+     * @param Looper looper 関数の種類（-lambdaize-looper に指定する名前）
+     * @param VaList 変数を va_list で渡すか
+     * @param Captures extracted 関数に渡す変数の数
+     * @param Batch 一度の呼び出しで行う繰り返しの回数
+     * @return 見積もられたコスト
+     * @details 一回の呼び出しで Batch 回繰り返す場合、呼び出しと受け渡しのコストはその回数で按分される
+     */
+    inline double getOverheadPerIteration(llvm::StringRef Looper, bool VaList, unsigned Captures, unsigned Batch)
+    {
+        return (getLooperCost(Looper, VaList) + getCaptureCost(VaList) * Captures) / std::max(Batch, 1u);
+    }
+}
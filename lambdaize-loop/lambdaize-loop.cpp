@@ -6,95 +6,1473 @@
 #define DEBUG_TYPE "lambdaize-loop"
 
 namespace {
+    /**
+     * @brief looper 関数と extracted 関数の間の引数の受け渡し方
+     */
+    enum class CaptureABI {
+        VaList, ///< 可変長引数として渡し、extracted 関数は va_list から取り出す
+        Struct, ///< 構造体にまとめて渡し、extracted 関数はそのポインタを受け取る
+    };
+
+    /**
+     * @brief extracted 関数を繰り返し呼び出す looper 関数の種類
+     */
+    enum class LooperKind {
+        Runtime,       ///< looper.bc で提供される looper 関数を間接呼び出しで使う
+        While,         ///< while ループで呼び出す looper 関数を呼び出し元ごとに合成する
+        Recursive,     ///< 再帰で呼び出す looper 関数を呼び出し元ごとに合成する
+        TailRecursive, ///< 末尾呼び出しが保証された再帰で呼び出す looper 関数を呼び出し元ごとに合成する
+    };
+
+    /**
+     * @brief ベクトル化されたループのうち難読化する部分
+     */
+    enum class VectorPart {
+        None,      ///< ループベクトル化を行わず、ベクトル化されたループも区別しない
+        Vector,    ///< ベクトル化されたループ本体（一回の繰り返しでベクトル幅分の処理を行う）
+        Remainder, ///< ベクトル化されずに残ったスカラーの剰余ループ
+        Both,      ///< ベクトル化されたループ本体と剰余ループの両方
+    };
+
+    /**
+     * @brief extracted 関数と合成した looper 関数の並べ方
+     */
+    enum class Layout {
+        None,    ///< 作成した順にモジュールの末尾に置く
+        Caller,  ///< 呼び出し元の関数の直後に置く
+        Profile, ///< ループヘッダの実行回数の多い順にモジュールの末尾に並べる
+    };
+
     llvm::cl::opt<bool> all (
         "all",
         llvm::cl::desc("Obfuscate unannotated loops"),
         llvm::cl::init(false)
     );
 
-    llvm::cl::opt<double> probability (
-        "prob",
-        llvm::cl::desc("Obfuscation rate"),
-        llvm::cl::init(1.)
-    );
+    llvm::cl::opt<double> probability (
+        "prob",
+        llvm::cl::desc("Obfuscation rate"),
+        llvm::cl::init(1.)
+    );
+
+    llvm::cl::opt<CaptureABI> abi (
+        "lambdaize-abi",
+        llvm::cl::desc("Calling convention between looper and extracted functions"),
+        llvm::cl::values(
+            clEnumValN(CaptureABI::VaList, "va_list", "Pass captured values as variadic arguments"),
+            clEnumValN(CaptureABI::Struct, "struct", "Pass a pointer to a struct of captured values")),
+        llvm::cl::init(CaptureABI::VaList)
+    );
+
+    llvm::cl::opt<LooperKind> looper_kind (
+        "lambdaize-looper",
+        llvm::cl::desc("Looper used to drive extracted functions"),
+        llvm::cl::values(
+            clEnumValN(LooperKind::Runtime, "runtime", "Call the looper function linked from looper.bc"),
+            clEnumValN(LooperKind::While, "while", "Synthesize a specialized looper with a while loop"),
+            clEnumValN(LooperKind::Recursive, "recursive", "Synthesize a specialized looper with recursion"),
+            clEnumValN(LooperKind::TailRecursive, "tailrec", "Synthesize a specialized looper with guaranteed tail recursion")),
+        llvm::cl::init(LooperKind::Runtime)
+    );
+
+    llvm::cl::opt<unsigned> batch (
+        "lambdaize-batch",
+        llvm::cl::desc("Number of original iterations run per extracted function call"),
+        llvm::cl::init(1)
+    );
+
+    llvm::cl::opt<unsigned> max_recursion (
+        "lambdaize-max-recursion",
+        llvm::cl::desc("Maximum recursion count of synthesized recursive loopers"),
+        llvm::cl::init(8192)
+    );
+
+    llvm::cl::opt<bool> skip_hot (
+        "lambdaize-skip-hot",
+        llvm::cl::desc("Skip loops whose header is hot according to the profile summary"),
+        llvm::cl::init(false)
+    );
+
+    llvm::cl::opt<uint64_t> hot_count (
+        "lambdaize-hot-count",
+        llvm::cl::desc("Skip loops whose profiled header count exceeds this value (0 means no limit)"),
+        llvm::cl::init(0)
+    );
+
+    llvm::cl::opt<uint64_t> profile_budget (
+        "lambdaize-profile-budget",
+        llvm::cl::desc("Total profiled header count allowed to be lambdaized per module, spent on the coldest loops first (0 means no limit)"),
+        llvm::cl::init(0)
+    );
+
+    llvm::cl::opt<double> max_overhead (
+        "lambdaize-max-overhead",
+        llvm::cl::desc("Estimated overhead allowed to be added per function call (0 means no limit)"),
+        llvm::cl::init(0.)
+    );
+
+    llvm::cl::opt<double> max_module_overhead (
+        "lambdaize-max-module-overhead",
+        llvm::cl::desc("Estimated overhead allowed to be added in total over a module (0 means no limit)"),
+        llvm::cl::init(0.)
+    );
+
+    llvm::cl::opt<double> max_overhead_ratio (
+        "lambdaize-max-overhead-ratio",
+        llvm::cl::desc("Estimated overhead per iteration allowed relative to the loop body size (0 means no limit)"),
+        llvm::cl::init(0.)
+    );
+
+    llvm::cl::opt<uint64_t> seed (
+        "lambdaize-seed",
+        llvm::cl::desc("Seed for deterministic loop selection (random on every run if not specified)")
+    );
+
+    llvm::cl::opt<bool> parallel (
+        "lambdaize-parallel",
+        llvm::cl::desc("Run loops annotated with llvm.loop.parallel_accesses on a thread pool"),
+        llvm::cl::init(false)
+    );
+
+    llvm::cl::opt<bool> nest (
+        "lambdaize-nest",
+        llvm::cl::desc("Drive each nest of selected loops from a single looper call"),
+        llvm::cl::init(false)
+    );
+
+    llvm::cl::opt<bool> merge (
+        "lambdaize-merge",
+        llvm::cl::desc("Merge structurally identical extracted functions after lambdaizing loops"),
+        llvm::cl::init(false)
+    );
+
+    llvm::cl::opt<std::string> section (
+        "lambdaize-section",
+        llvm::cl::desc("Section to place extracted functions and synthesized loopers in (unchanged if not specified)"),
+        llvm::cl::init("")
+    );
+
+    llvm::cl::opt<unsigned> alignment (
+        "lambdaize-align",
+        llvm::cl::desc("Alignment in bytes of extracted functions and synthesized loopers (0 means the target default)"),
+        llvm::cl::init(0)
+    );
+
+    llvm::cl::opt<Layout> layout (
+        "lambdaize-layout",
+        llvm::cl::desc("Order of extracted functions and synthesized loopers in the module"),
+        llvm::cl::values(
+            clEnumValN(Layout::None, "none", "Append them to the module in creation order"),
+            clEnumValN(Layout::Caller, "caller", "Place them right after their caller"),
+            clEnumValN(Layout::Profile, "profile", "Append them to the module in descending order of profiled loop header count")),
+        llvm::cl::init(Layout::None)
+    );
+
+    llvm::cl::opt<VectorPart> vectorize (
+        "lambdaize-vectorize",
+        llvm::cl::desc("Run the loop vectorizer before lambdaizing and choose which part of vectorized loops to lambdaize"),
+        llvm::cl::values(
+            clEnumValN(VectorPart::None, "none", "Do not run the loop vectorizer"),
+            clEnumValN(VectorPart::Vector, "vector", "Lambdaize vector loops so that each iteration runs a full vector-width block"),
+            clEnumValN(VectorPart::Remainder, "remainder", "Lambdaize only scalar remainder loops"),
+            clEnumValN(VectorPart::Both, "both", "Lambdaize both vector loops and scalar remainder loops")),
+        llvm::cl::init(VectorPart::None)
+    );
+
+    using lambdaize_attributes::BatchAttribute;
+    using lambdaize_attributes::ExtractedAttribute;
+    using lambdaize_attributes::LooperAttribute;
+
+    /**
+     * @brief LambdaizeLoop パスが処理を終えた関数に付ける関数属性の名前
+     * @details ThinLTO ではコンパイル時（pre-link）とリンク時のバックエンド（post-link）の両方でパスが実行されうるため、
+     * @details この属性を持つ関数は処理しないことで同じループを二度難読化しないようにする
+     * @note 関数単位で記録するため、関数のインポートや LTO でのモジュールの結合を経ても失われない
+     */
+    constexpr llvm::StringLiteral ProcessedAttribute = "lambdaize-processed";
+
+    /**
+     * @brief extracted 関数とループの識別子の組を置くセクションの名前
+     * @note リンカが __start_ と __stop_ を定義できるよう、C の識別子として有効な名前とする
+     */
+    constexpr llvm::StringLiteral LoopIdSection = "lambdaize_loops";
+
+    /**
+     * @brief LambdaizeLoop パスの実装
+     */
+    class LambdaizeLoop : public llvm::PassInfoMixin<LambdaizeLoop> {
+    public:
+        /**
+         * @brief パスの処理の実体
+         * @note lambdaizeloop メタデータを持つループのみ処理を行う
+         * @note プロファイル情報がある場合は、それに基づいて処理するループを絞り込む
+         * @note すでに処理を終えた関数（ProcessedAttribute を持つもの）は処理しない
+         */
+        llvm::PreservedAnalyses run(llvm::Module &Module, llvm::ModuleAnalysisManager &MAM)
+        {
+            auto &FAM = MAM.getResult<llvm::FunctionAnalysisManagerModuleProxy>(Module).getManager();
+            auto &PSI = MAM.getResult<llvm::ProfileSummaryAnalysis>(Module);
+            Engine.seed(std::random_device{}());
+
+            // 処理中に extracted 関数が追加されていくため、処理対象の関数はあらかじめ列挙しておく
+            std::vector<llvm::Function *> Functions;
+            for (auto &Function : Module) {
+                if (!Function.isDeclaration() && !Function.hasFnAttribute(ProcessedAttribute)) {
+                    Functions.push_back(&Function);
+                }
+            }
+
+            // 全ての関数から候補となるループを集めたうえで、処理するループを選ぶ
+            std::vector<Candidate> Candidates;
+            std::vector<llvm::Function *> Considered;
+            for (auto *Function : Functions) {
+                if (collectCandidates(*Function, FAM, PSI, std::back_inserter(Candidates))) {
+                    Considered.push_back(Function);
+                }
+            }
+            llvm::SmallPtrSet<llvm::Loop *, 16> Selected;
+            selectByProfile(Candidates, Selected);
+            selectByOverhead(Candidates, Selected);
+            llvm::DenseMap<llvm::Loop *, const Candidate *> CandidateOf;
+            for (const auto &Entry : Candidates) {
+                CandidateOf[Entry.Loop] = &Entry;
+            }
+
+            // ループの変形は外側のループから順に行う
+            bool Changed = false;
+            std::vector<Placement> Placements;
+            for (auto *Function : Functions) {
+                auto Loops = FAM.getResult<llvm::LoopAnalysis>(*Function).getLoopsInPreorder();
+                auto &ORE = FAM.getResult<llvm::OptimizationRemarkEmitterAnalysis>(*Function);
+
+                // 入れ子になったループをまとめて扱う場合は、選ばれたループを最も外側の選ばれたループごとにまとめる
+                llvm::DenseMap<llvm::Loop *, llvm::SmallVector<llvm::Loop *, 4>> Nests;
+                llvm::SmallPtrSet<llvm::Loop *, 16> Nested;
+                if (nest) {
+                    for (auto *Loop : Loops) {
+                        if (!Selected.count(Loop)) {
+                            continue;
+                        }
+                        auto *Root = Loop;
+                        for (auto *Parent = Loop->getParentLoop(); Parent; Parent = Parent->getParentLoop()) {
+                            if (Selected.count(Parent)) {
+                                Root = Parent;
+                            }
+                        }
+                        if (Root != Loop) {
+                            Nests[Root].push_back(Loop);
+                            Nested.insert(Loop);
+                        }
+                    }
+                }
+
+                // 並列に実行するループは、ScalarEvolution が有効なうちに IR を書き換える前に調べておく
+                // 調べる段階では IR を変更せず、変形できることが確定したループについてのみ繰り返し回数を preheader で求める
+                llvm::DenseMap<llvm::Loop *, ParallelPlan> Plans;
+                if (parallel) {
+                    auto &SE = FAM.getResult<llvm::ScalarEvolutionAnalysis>(*Function);
+                    for (auto *Loop : Loops) {
+                        if (Selected.count(Loop) && !Nests.count(Loop) && !Nested.count(Loop)) {
+                            if (auto Plan = planParallel(*Loop, SE, ORE); Plan && isExtractable(*Loop, ORE, CaptureABI::Struct)) {
+                                Plans[Loop] = std::move(*Plan);
+                            }
+                        }
+                    }
+                    for (auto *Loop : Loops) {
+                        if (auto Plan = Plans.find(Loop); Plan != Plans.end()) {
+                            expandTripCount(*Loop, Plan->second, SE);
+                        }
+                    }
+                }
+
+                // 繰り返し回数を求める命令が挿入されていれば、関数は変更されている
+                bool FunctionChanged = !Plans.empty();
+                for (auto *Loop : Loops) {
+                    if (!Selected.count(Loop) || Nested.count(Loop)) {
+                        continue;
+                    }
+                    // ループのブロックは extracted 関数に移されるため、リマークの位置は変形の前に求めておく
+                    auto Location = Loop->getStartLoc();
+                    auto *Preheader = Loop->getLoopPreheader();
+                    auto *Last = &Module.getFunctionList().back();
+                    std::optional<Extraction> Result;
+                    if (auto Nest = Nests.find(Loop); Nest != Nests.end()) {
+                        Result = extractLoopNest(*Loop, Nest->second, ORE);
+                    } else {
+                        auto Plan = Plans.find(Loop);
+                        Result = extractLoopIntoFunction(*Loop, Plan != Plans.end() ? &Plan->second : nullptr, ORE);
+                    }
+                    if (Result) {
+                        auto *Chosen = CandidateOf.lookup(Loop);
+                        remarkLambdaized(ORE, Location, Preheader, *Result, Chosen->Overhead);
+                        FunctionChanged = true;
+
+                        // 新たに作成された関数はモジュールの末尾に追加されている
+                        Placement NewPlacement{Function, Chosen->ProfileCount, {}};
+                        for (auto It = std::next(Last->getIterator()); It != Module.end(); ++It) {
+                            if (!It->isDeclaration()) {
+                                NewPlacement.Functions.push_back(&*It);
+                            }
+                        }
+                        // 実行時の looper 関数に渡される extracted 関数には、計測結果と対応づけるための識別子を登録する
+                        if (looper_kind == LooperKind::Runtime || Result->Parallel) {
+                            for (auto *Created : NewPlacement.Functions) {
+                                if (Created->hasFnAttribute(ExtractedAttribute)) {
+                                    registerLoopId(*Created, Chosen->Id);
+                                }
+                            }
+                        }
+                        Placements.push_back(std::move(NewPlacement));
+                    }
+                }
+                if (FunctionChanged) {
+                    FAM.invalidate(*Function, llvm::PreservedAnalyses::none());
+                    Changed = true;
+                }
+            }
+            placeExtracted(Module, Placements);
+
+            // 対象のループを含んでいた関数と、作成した extracted 関数や looper 関数を処理済みとする
+            // 関数属性を付けるだけでは解析結果は変わらないため、Changed には含めない
+            for (auto *Function : Considered) {
+                Function->addFnAttr(ProcessedAttribute);
+            }
+            for (const auto &Entry : Placements) {
+                for (auto *Function : Entry.Functions) {
+                    Function->addFnAttr(ProcessedAttribute);
+                }
+            }
+            return Changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
+        }
+
+    private:
+        /**
+         * @brief seed が指定されていない場合に、ループを難読化するか否かを決めるための乱数生成器
+         * @note ThinLTO のバックエンドでは複数のモジュールが並列に処理されるため、
+         * @note 状態を共有しないようにパスのインスタンスごとに持ち、モジュールを処理するたびに初期化する
+         */
+        std::mt19937_64 Engine;
+
+        /**
+         * @brief ループを難読化することで増える実行コストの見積もり
+         * @note コストの単位はおおよそ命令数である
+         */
+        struct OverheadEstimate {
+            double TripCount;    ///< 関数の呼び出し一回あたりのループの繰り返し回数
+            unsigned Captures;   ///< extracted 関数に渡される変数の数
+            unsigned BodySize;   ///< ループ本体の命令数
+            double PerIteration; ///< 繰り返し一回あたりに増えるコスト
+
+            /**
+             * @brief 関数の呼び出し一回あたりに増えるコスト
+             */
+            double total() const
+            {
+                return TripCount * PerIteration;
+            }
+
+            /**
+             * @brief ループ本体の大きさに対する、繰り返し一回あたりに増えるコストの比
+             */
+            double ratio() const
+            {
+                return PerIteration / std::max(BodySize, 1u);
+            }
+        };
+
+        /**
+         * @brief ループの大きさとループの外から使われる変数の集計
+         * @note 内側のループの集計を再利用して外側のループの分を求めるため、ループごとに一度だけ作る
+         */
+        struct LoopSummary {
+            unsigned BodySize = 0;                          ///< ループ本体の命令数（内側のループの分も含む）
+            llvm::SmallSetVector<llvm::Value *, 8> Captures; ///< ループの外で定義され、ループの中で使われる非グローバル変数
+        };
+
+        /**
+         * @brief 並列に実行するループの変形に必要な情報
+         */
+        struct ParallelPlan {
+            const llvm::SCEV *TripCountExpr; ///< ループの繰り返し回数（i64 型）
+            llvm::Value *TripCount;          ///< 変形が確定した後に preheader で求めた繰り返し回数（それまでは nullptr）
+
+            /// header の PHI 命令（すべて整数の帰納変数である）とその増分
+            llvm::SmallVector<std::pair<llvm::PHINode *, llvm::ConstantInt *>, 4> Inductions;
+        };
+
+        /**
+         * @brief 難読化の候補となるループ
+         */
+        struct Candidate {
+            llvm::Loop *Loop;                     ///< 候補となるループ
+            std::optional<uint64_t> ProfileCount; ///< プロファイルから求めたループヘッダの実行回数
+            OverheadEstimate Overhead;            ///< 難読化することで増える実行コストの見積もり
+            llvm::OptimizationRemarkEmitter *ORE; ///< ループを含む関数の OptimizationRemarkEmitter
+            std::string Id;                       ///< looper 関数の計測結果と対応づけるためのループの識別子
+        };
+
+        /**
+         * @brief 一つのループ（もしくは入れ子）の置換で作成された関数とその配置に必要な情報
+         */
+        struct Placement {
+            llvm::Function *Caller;                          ///< ループを含んでいた関数
+            std::optional<uint64_t> ProfileCount;            ///< プロファイルから求めたループヘッダの実行回数
+            llvm::SmallVector<llvm::Function *, 4> Functions; ///< 作成された extracted 関数と looper 関数（作成順）
+        };
+
+        /**
+         * @brief ループを extracted 関数で置換した結果
+         */
+        struct Extraction {
+            unsigned Captures; ///< extracted 関数に渡される変数の数
+            unsigned Loops;    ///< 一つの extracted 関数にまとめられたループの数
+            bool Parallel;     ///< looper_parallel 関数で並列に実行されるか
+            CaptureABI ABI;    ///< キャプチャされた変数の受け渡し方
+        };
+
+        /**
+         * @brief 関数内のループのうち、難読化の候補となるものを列挙する
+         * @param Function 対象の関数
+         * @param FAM 関数の解析結果を得るための FunctionAnalysisManager
+         * @param PSI モジュールのプロファイル概要
+         * @param[out] Result Candidate への出力イテレータ
+         * @return 難読化の対象として扱われたループ（lambdaizeloop メタデータを持つもの、all の場合は全てのループ）があったか
+         * @note 候補は外側のループから順に出力される
+         */
+        template <class OutputIterator>
+        bool collectCandidates(llvm::Function &Function, llvm::FunctionAnalysisManager &FAM, llvm::ProfileSummaryInfo &PSI, OutputIterator Result)
+        {
+            auto &LoopInfo = FAM.getResult<llvm::LoopAnalysis>(Function);
+            auto &BFI = FAM.getResult<llvm::BlockFrequencyAnalysis>(Function);
+            auto &SE = FAM.getResult<llvm::ScalarEvolutionAnalysis>(Function);
+            auto &ORE = FAM.getResult<llvm::OptimizationRemarkEmitterAnalysis>(Function);
+            auto Summaries = summarizeLoops(Function, LoopInfo);
+            unsigned Index = 0;
+            bool Considered = false;
+            for (auto *Loop : LoopInfo.getLoopsInPreorder()) {
+                auto LoopIndex = Index++;
+                if (!all && !LoopContainsMetadata(*Loop, "lambdaizeloop")) {
+                    ORE.emit([&] { return missed("NotAnnotated", *Loop) << "\"lambdaizeloop\" metadata is not set"; });
+                    continue;
+                }
+                Considered = true;
+                if (!isSelectedVectorPart(*Loop)) {
+                    ORE.emit([&] {
+                        return missed("VectorPartSkipped", *Loop)
+                            << (isVectorBody(*Loop) ? "vector loop" : "scalar remainder loop") << " is kept intact";
+                    });
+                    continue;
+                }
+                // 並列に実行されうるループは、va_list によらず構造体渡しで変形できるかを確かめる
+                // 並列に実行できなかった場合は、置換する際に改めて getCaptureABI の受け渡し方で変形できるかを確かめる
+                auto ABI = parallel && Loop->isAnnotatedParallel() ? CaptureABI::Struct : getCaptureABI(*Loop);
+                if (!isExtractable(*Loop, ORE, ABI)) {
+                    continue;
+                }
+                if (drawSelection(Function, LoopIndex) >= probability) {
+                    ORE.emit([&] {
+                        return missed("NotSelected", *Loop)
+                            << "not selected with probability " << llvm::ore::NV("Probability", formatCost(probability));
+                    });
+                    continue;
+                }
+                if (skip_hot && PSI.isHotBlock(Loop->getHeader(), &BFI)) {
+                    ORE.emit([&] { return missed("Hot", *Loop) << "loop is hot according to the profile summary"; });
+                    continue;
+                }
+
+                Candidate NewCandidate{Loop, std::nullopt, estimateOverhead(*Loop, Summaries[Loop], SE, BFI), &ORE, getLoopId(Function, *Loop, LoopIndex)};
+                if (auto Count = BFI.getBlockProfileCount(Loop->getHeader())) {
+                    NewCandidate.ProfileCount = *Count;
+                }
+                *Result++ = NewCandidate;
+            }
+            return Considered;
+        }
+
+        /**
+         * @brief 作成した関数のセクション、アラインメント、モジュール内での順序を設定する
+         * @param Module 対象のモジュール
+         * @param Placements 作成した関数の一覧（作成順）
+         * @details 繰り返しのたびに looper 関数と extracted 関数の間を行き来するため、両者を同じセクションに置いたり
+         * @details 呼び出し元の近くに並べたりすることで、命令キャッシュと i-TLB のミスを減らせる
+         * @note プロファイル情報がある場合は、ループヘッダの実行回数を extracted 関数の実行回数として設定する
+         */
+        void placeExtracted(llvm::Module &Module, std::vector<Placement> &Placements)
+        {
+            if (alignment && !llvm::isPowerOf2_32(alignment)) {
+                llvm::report_fatal_error("-lambdaize-align must be a power of two");
+            }
+            for (const auto &Entry : Placements) {
+                for (auto *Function : Entry.Functions) {
+                    if (!section.empty()) {
+                        Function->setSection(section);
+                    }
+                    if (alignment) {
+                        Function->setAlignment(llvm::Align(alignment));
+                    }
+                    if (Entry.ProfileCount && Function->hasFnAttribute(ExtractedAttribute)) {
+                        Function->setEntryCount(*Entry.ProfileCount);
+                    }
+                }
+            }
+
+            // 関数の移動は、シンボルテーブルを更新しないよう同じリスト内での splice で行う
+            auto &List = Module.getFunctionList();
+            switch (layout) {
+            case Layout::None:
+                break;
+            case Layout::Caller: {
+                // 同じ関数から作成された関数は、作成順に呼び出し元の直後へ続けて並べる
+                llvm::DenseMap<llvm::Function *, llvm::Function *> Tail;
+                for (const auto &Entry : Placements) {
+                    auto *&Previous = Tail.try_emplace(Entry.Caller, Entry.Caller).first->second;
+                    for (auto *Function : Entry.Functions) {
+                        List.splice(std::next(Previous->getIterator()), List, Function->getIterator());
+                        Previous = Function;
+                    }
+                }
+                break;
+            }
+            case Layout::Profile:
+                // プロファイル情報のないループは最後に回す
+                llvm::stable_sort(Placements, [](const auto &LHS, const auto &RHS) {
+                    return LHS.ProfileCount.value_or(0) > RHS.ProfileCount.value_or(0);
+                });
+                for (const auto &Entry : Placements) {
+                    for (auto *Function : Entry.Functions) {
+                        List.splice(List.end(), List, Function->getIterator());
+                    }
+                }
+                break;
+            }
+        }
+
+        /**
+         * @brief ループを難読化するか否かを決めるための [0, 1) の値を得る
+         * @param Function ループを含む関数
+         * @param LoopIndex 関数内でのループの前順の番号
+         * @return 得られた値
+         * @details seed が指定されている場合は、seed と関数名とループの番号のハッシュから値を求めるため、
+         * @details 同じ入力に対しては関数が処理される順番によらず常に同じ値が得られる
+         */
+        double drawSelection(const llvm::Function &Function, unsigned LoopIndex)
+        {
+            if (!seed.getNumOccurrences()) {
+                return std::uniform_real_distribution<>(0., 1.)(Engine);
+            }
+            llvm::SmallString<64> Key;
+            llvm::raw_svector_ostream(Key) << seed << ':' << Function.getName() << ':' << LoopIndex;
+
+            // 上位 53 bit を仮数部として用いる
+            return (llvm::xxHash64(Key) >> 11) * 0x1.0p-53;
+        }
+
+        /**
+         * @brief ループの識別子を求める
+         * @param Function ループを含む関数
+         * @param Loop 対象のループ
+         * @param LoopIndex 関数内でのループの前順の番号
+         * @return デバッグ情報がある場合は "ファイル名:行:列"、ない場合は "関数名#ループの番号"
+         * @note いずれもビルドをまたいで変わらないため、実行時の計測結果をソース上のループに対応づけられる
+         */
+        std::string getLoopId(const llvm::Function &Function, const llvm::Loop &Loop, unsigned LoopIndex)
+        {
+            if (auto Location = Loop.getStartLoc()) {
+                return llvm::formatv("{0}:{1}:{2}", Location->getFilename(), Location.getLine(), Location.getCol()).str();
+            }
+            return llvm::formatv("{0}#{1}", Function.getName(), LoopIndex).str();
+        }
+
+        /**
+         * @brief extracted 関数とループの識別子の組を lambdaize_loops セクションに書き出す
+         * @param Extracted 実行時の looper 関数に渡される extracted 関数
+         * @param Id ループの識別子
+         * @details looper.bc は TELEMETRY=yes でビルドされた場合に、リンカが定義する __start_lambdaize_loops と
+         * @details __stop_lambdaize_loops の間からこの組を探し、計測結果を識別子ごとにまとめる
+         */
+        void registerLoopId(llvm::Function &Extracted, llvm::StringRef Id)
+        {
+            auto &Module = *Extracted.getParent();
+            auto &Context = Module.getContext();
+            auto *Name = llvm::ConstantDataArray::getString(Context, Id);
+            auto *NameVariable = new llvm::GlobalVariable(
+                Module, Name->getType(), true /* constant */,
+                llvm::GlobalValue::LinkageTypes::PrivateLinkage, Name, Extracted.getName() + ".id.name");
+            NameVariable->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+
+            auto *Entry = llvm::ConstantStruct::getAnon({&Extracted, NameVariable});
+            auto *EntryVariable = new llvm::GlobalVariable(
+                Module, Entry->getType(), true /* constant */,
+                llvm::GlobalValue::LinkageTypes::InternalLinkage, Entry, Extracted.getName() + ".id");
+            EntryVariable->setSection(LoopIdSection);
+            EntryVariable->setAlignment(Module.getDataLayout().getPointerABIAlignment(0));
+            // どこからも参照されないため、最適化で取り除かれないようにする
+            llvm::appendToCompilerUsed(Module, {EntryVariable});
+        }
+
+        /**
+         * @brief プロファイルから求めた実行回数に基づいて、難読化するループを選ぶ
+         * @param Candidates 難読化の候補となるループの一覧
+         * @param[out] Selected 選ばれたループの集合
+         * @details 実行回数が hot_count を超えるループは除外したうえで、実行回数の少ないループから順に
+         * @details 合計が profile_budget に収まる範囲で選ぶ
+         * @note プロファイル情報のないループは、これらの条件によらず常に選ばれる
+         */
+        void selectByProfile(std::vector<Candidate> &Candidates, llvm::SmallPtrSetImpl<llvm::Loop *> &Selected)
+        {
+            // プロファイル情報のないループを先頭に、それ以外は実行回数の昇順に並べる
+            llvm::stable_sort(Candidates, [](const auto &LHS, const auto &RHS) {
+                return LHS.ProfileCount.value_or(0) < RHS.ProfileCount.value_or(0);
+            });
+
+            uint64_t Spent = 0;
+            for (const auto &Entry : Candidates) {
+                if (!Entry.ProfileCount) {
+                    Selected.insert(Entry.Loop);
+                    continue;
+                }
+                auto Count = *Entry.ProfileCount;
+                if (hot_count && Count > hot_count) {
+                    Entry.ORE->emit([&] {
+                        return missed("ProfileCountExceeded", *Entry.Loop)
+                            << "profile count " << llvm::ore::NV("ProfileCount", Count)
+                            << " exceeds threshold " << llvm::ore::NV("HotCount", hot_count.getValue());
+                    });
+                    continue;
+                }
+                if (profile_budget && Spent + Count > profile_budget) {
+                    Entry.ORE->emit([&] {
+                        return missed("ProfileBudgetExhausted", *Entry.Loop)
+                            << "profile count " << llvm::ore::NV("ProfileCount", Count)
+                            << " exceeds remaining budget " << llvm::ore::NV("RemainingBudget", profile_budget - Spent);
+                    });
+                    continue;
+                }
+                Spent += Count;
+                Selected.insert(Entry.Loop);
+            }
+        }
+
+        /**
+         * @brief 難読化することで増える実行コストの見積もりに基づいて、難読化するループを絞り込む
+         * @param Candidates 難読化の候補となるループの一覧
+         * @param[in,out] Selected 選ばれたループの集合
+         * @details 増えるコストの小さいループから順に、関数ごとの合計が max_overhead に、
+         * @details モジュール全体の合計が max_module_overhead に収まる範囲で選ぶ
+         * @details また、ループ本体に対するコストの比が max_overhead_ratio を超えるループは除外する
+         */
+        void selectByOverhead(std::vector<Candidate> &Candidates, llvm::SmallPtrSetImpl<llvm::Loop *> &Selected)
+        {
+            llvm::stable_sort(Candidates, [](const auto &LHS, const auto &RHS) {
+                return LHS.Overhead.total() < RHS.Overhead.total();
+            });
+
+            llvm::DenseMap<llvm::Function *, double> FunctionSpent;
+            double ModuleSpent = 0.;
+            for (const auto &Entry : Candidates) {
+                if (!Selected.count(Entry.Loop)) {
+                    continue;
+                }
+                auto &Spent = FunctionSpent[Entry.Loop->getHeader()->getParent()];
+                auto Total = Entry.Overhead.total();
+                if (max_overhead_ratio > 0. && Entry.Overhead.ratio() > max_overhead_ratio) {
+                    Entry.ORE->emit([&] {
+                        return missed("OverheadRatioExceeded", *Entry.Loop)
+                            << "estimated overhead per iteration "
+                            << llvm::ore::NV("OverheadPerIteration", formatCost(Entry.Overhead.PerIteration))
+                            << " is too large for a body of " << llvm::ore::NV("BodySize", Entry.Overhead.BodySize)
+                            << " instructions";
+                    });
+                    Selected.erase(Entry.Loop);
+                    continue;
+                }
+                if ((max_overhead > 0. && Spent + Total > max_overhead) ||
+                    (max_module_overhead > 0. && ModuleSpent + Total > max_module_overhead)) {
+                    Entry.ORE->emit([&] {
+                        return missed("OverheadBudgetExhausted", *Entry.Loop)
+                            << "estimated overhead " << llvm::ore::NV("EstimatedOverhead", formatCost(Total))
+                            << " exceeds remaining budget";
+                    });
+                    Selected.erase(Entry.Loop);
+                    continue;
+                }
+                Spent += Total;
+                ModuleSpent += Total;
+            }
+        }
+
+        /**
+         * @brief 関数内の全てのループについて、大きさとループの外から使われる変数を集計する
+         * @param Function 対象の関数
+         * @param LoopInfo 関数の LoopInfo
+         * @return ループごとの集計結果
+         * @details 内側のループから順に、各ループに直接属するブロックの分と、内側のループの変数のうちそのループの外で定義されたものを合わせる
+         * @details 各ブロックは一度しか走査しないので、深い入れ子でも内側のループを何度も走査することはない
+         */
+        llvm::DenseMap<const llvm::Loop *, LoopSummary> summarizeLoops(llvm::Function &Function, llvm::LoopInfo &LoopInfo)
+        {
+            // ブロックを、それを直接含む（最も内側の）ループごとに分ける
+            llvm::DenseMap<const llvm::Loop *, llvm::SmallVector<llvm::BasicBlock *, 8>> OwnBlocks;
+            for (auto &&Block : Function) {
+                if (auto *Loop = LoopInfo.getLoopFor(&Block)) {
+                    OwnBlocks[Loop].push_back(&Block);
+                }
+            }
+
+            llvm::DenseMap<const llvm::Loop *, LoopSummary> Summaries;
+            auto Preorder = LoopInfo.getLoopsInPreorder();
+            for (auto *Loop : llvm::reverse(Preorder)) {
+                auto &Summary = Summaries[Loop];
+                auto isDefinedInside = [&](llvm::Value *Value) {
+                    auto *Inst = llvm::dyn_cast<llvm::Instruction>(Value);
+                    return Inst && Loop->contains(Inst);
+                };
+                for (auto *Block : OwnBlocks.lookup(Loop)) {
+                    Summary.BodySize += Block->size();
+                    std::vector<llvm::Value *> OutsideDefined;
+                    setOutsideDefinedVariables(&Block, &Block + 1, std::back_inserter(OutsideDefined));
+                    for (auto *Value : OutsideDefined) {
+                        if (!isDefinedInside(Value)) {
+                            Summary.Captures.insert(Value);
+                        }
+                    }
+                }
+                // 逆順の前順序では内側のループが先に集計されている
+                for (auto *SubLoop : *Loop) {
+                    auto &Inner = Summaries[SubLoop];
+                    Summary.BodySize += Inner.BodySize;
+                    for (auto *Value : Inner.Captures) {
+                        if (!isDefinedInside(Value)) {
+                            Summary.Captures.insert(Value);
+                        }
+                    }
+                }
+            }
+            return Summaries;
+        }
+
+        /**
+         * @brief ループを難読化することで増える実行コストを見積もる
+         * @param Loop 見積もり対象のループ
+         * @param Summary summarizeLoops で求めたループの集計結果
+         * @param SE 関数の ScalarEvolution
+         * @param BFI 関数の BlockFrequencyInfo
+         * @return 見積もり結果
+         * @details 繰り返し一回あたりに looper 関数を経由する呼び出しと変数の受け渡しのコストが増えるものとし、
+         * @details それに関数の呼び出し一回あたりの繰り返し回数をかけたものを全体のコストとする
+         */
+        OverheadEstimate estimateOverhead(llvm::Loop &Loop, const LoopSummary &Summary, llvm::ScalarEvolution &SE, llvm::BlockFrequencyInfo &BFI)
+        {
+            OverheadEstimate Result{};
+
+            // 繰り返し回数は、ScalarEvolution で求まればそれにループへの到達頻度をかけたものを、
+            // 求まらなければ BlockFrequencyInfo によるループヘッダの実行頻度を用いる
+            double EntryFreq = std::max<uint64_t>(BFI.getEntryFreq(), 1);
+            if (auto TripCount = SE.getSmallConstantTripCount(&Loop)) {
+                Result.TripCount = TripCount * (BFI.getBlockFreq(Loop.getLoopPreheader()).getFrequency() / EntryFreq);
+            } else {
+                Result.TripCount = BFI.getBlockFreq(Loop.getHeader()).getFrequency() / EntryFreq;
+            }
+
+            Result.Captures = Summary.Captures.size();
+            Result.BodySize = Summary.BodySize;
+
+            Result.PerIteration = lambdaize_cost::getOverheadPerIteration(
+                getLooperName(), getCaptureABI(Loop) == CaptureABI::VaList, Result.Captures, batch);
+            return Result;
+        }
+
+        /**
+         * @brief ループを難読化しなかったことを表す最適化リマークを作る
+         * @param Name リマークの名前（難読化しなかった理由ごとに異なる）
+         * @param Loop 対象のループ
+         * @return 作成したリマーク（理由は呼び出し元で追記する）
+         */
+        llvm::OptimizationRemarkMissed missed(llvm::StringRef Name, const llvm::Loop &Loop)
+        {
+            return llvm::OptimizationRemarkMissed(DEBUG_TYPE, Name, Loop.getStartLoc(), Loop.getHeader())
+                << "loop not lambdaized: ";
+        }
+
+        /**
+         * @brief ループを難読化したことを最適化リマークとして報告する
+         * @param ORE ループを含む関数の OptimizationRemarkEmitter
+         * @param Location ループの位置
+         * @param Preheader ループの preheader（looper 関数の呼び出しが挿入されたブロック）
+         * @param Result 置換の結果
+         * @param Overhead 難読化することで増える実行コストの見積もり
+         * @note 引数には、looper 関数の種類、変数の受け渡し方、キャプチャされた変数の数、コストの見積もりを含める
+         */
+        void remarkLambdaized(llvm::OptimizationRemarkEmitter &ORE, const llvm::DebugLoc &Location,
+                              llvm::BasicBlock *Preheader, const Extraction &Result, const OverheadEstimate &Overhead)
+        {
+            ORE.emit([&] {
+                llvm::OptimizationRemark Remark(DEBUG_TYPE, Result.Loops > 1 ? "LambdaizedNest" : "Lambdaized", Location, Preheader);
+                Remark << "lambdaized ";
+                if (Result.Loops > 1) {
+                    Remark << "nest of " << llvm::ore::NV("Loops", Result.Loops) << " loops";
+                } else {
+                    Remark << "loop";
+                }
+                Remark << " with " << llvm::ore::NV("Captures", Result.Captures) << " captured values using "
+                       << llvm::ore::NV("Looper", Result.Parallel ? "parallel" : getLooperName()) << " looper and "
+                       << llvm::ore::NV("ABI", Result.ABI == CaptureABI::Struct ? "struct" : "va_list")
+                       << " ABI (estimated overhead "
+                       << llvm::ore::NV("OverheadPerIteration", formatCost(Overhead.PerIteration))
+                       << " per iteration, "
+                       << llvm::ore::NV("EstimatedOverhead", formatCost(Overhead.total())) << " per call)";
+                return Remark;
+            });
+        }
+
+        /**
+         * @brief リマークに含める小数を書式化する
+         * @param Value 書式化する値
+         * @return 小数点以下 2 桁で表した文字列
+         * @note float を受け取る llvm::ore::NV は指数表記になり読みにくいため、文字列として渡す
+         */
+        std::string formatCost(double Value)
+        {
+            return llvm::formatv("{0:F2}", Value).str();
+        }
+
+        /**
+         * @brief looper_kind の名前を得る
+         * @return -lambdaize-looper に指定する名前
+         */
+        llvm::StringRef getLooperName()
+        {
+            switch (looper_kind) {
+            case LooperKind::Runtime:
+                return "runtime";
+            case LooperKind::While:
+                return "while";
+            case LooperKind::Recursive:
+                return "recursive";
+            case LooperKind::TailRecursive:
+                return "tailrec";
+            }
+            llvm_unreachable("unknown looper kind");
+        }
+
+        /**
+         * @brief 指定の文字列がループメタデータに含まれるか判定する
+         * @param Loop 判定対象のループ
+         * @param Str 判定対象の文字列
+         * @return Loop のメタデータ内に Str が含まれるか
+         */
+        bool LoopContainsMetadata(const llvm::Loop &Loop, const llvm::StringRef Str)
+        {
+            if (auto *LoopID = Loop.getLoopID()) {
+                return LoopIDContainsMetadata(*LoopID, Str);
+            }
+            return false;
+        }
+
+        /**
+         * @brief ループのメタデータ（llvm.loop）に文字列が含まれているか判定する
+         * @param LoopID 判定対象のメタデータ
+         * @param Str 判定対象の文字列
+         * @return LoopID 内に Str が含まれるか
+         * @note latch の終端命令から直接メタデータを読む場合など、Loop がない場合に用いる
+         */
+        bool LoopIDContainsMetadata(const llvm::MDNode &LoopID, const llvm::StringRef Str)
+        {
+            // "For legacy reasons, the first item of a loop metadata node must be a reference to itself."
+            // see https://llvm.org/docs/LangRef.html#llvm-loop
+
+            // TODO: replace with std:: when C++20 is available.
+            return llvm::any_of(
+                LoopID.operands().drop_front(),
+                [Str](const auto &MDOperand) {
+                    const auto Metadata = llvm::cast<llvm::MDNode>(MDOperand.get());
+                    return Metadata->getOperand(0).equalsStr(Str);
+                });
+        }
+
+        /**
+         * @brief ループが vectorize で指定された難読化する部分に当たるか判定する
+         * @param Loop 判定対象のループ
+         * @return 難読化する部分に当たるか
+         * @note ループベクトル化によって作られたのではないループは常に難読化する部分に当たる
+         */
+        bool isSelectedVectorPart(const llvm::Loop &Loop)
+        {
+            if (vectorize == VectorPart::None || vectorize == VectorPart::Both ||
+                !LoopContainsMetadata(Loop, "llvm.loop.isvectorized")) {
+                return true;
+            }
+            return isVectorBody(Loop) == (vectorize == VectorPart::Vector);
+        }
+
+        /**
+         * @brief ベクトル化されたループが、ベクトル化されたループ本体であるか判定する
+         * @param Loop 判定対象のループ（llvm.loop.isvectorized を持つ）
+         * @return ループ本体であるか（そうでない場合は剰余ループである）
+         * @details ベクトル型の値を扱う命令を含むループ（エピローグのベクトル化で作られたループも含む）はループ本体とする
+         * @details そうでない場合（インターリーブのみのループなど）は CFG の形から判断し、preheader が別のベクトル化されたループの
+         * @details latch の直後（middle ブロック）から到達するループを剰余ループとする
+         * @note llvm.loop.unroll.runtime.disable は実行時の依存検査を行う場合は剰余ループに付かず、
+         * @note ターゲットによってはループ本体にも付くため、形から判断できない場合の手がかりとしてのみ用いる
+         */
+        bool isVectorBody(const llvm::Loop &Loop)
+        {
+            auto isVector = [](const llvm::Value *Value) { return Value->getType()->isVectorTy(); };
+            bool HasVectorValue = llvm::any_of(Loop.blocks(), [&](auto *Block) {
+                return llvm::any_of(*Block, [&](auto &&Inst) {
+                    return isVector(&Inst) || llvm::any_of(Inst.operand_values(), isVector);
+                });
+            });
+            if (HasVectorValue) {
+                return true;
+            }
+
+            // 剰余ループの preheader（scalar.ph）は、ループ本体の latch から middle ブロックを経て到達する
+            // 最適化によって middle ブロックがまとめられている場合は latch から直接到達する
+            if (auto *Preheader = Loop.getLoopPreheader()) {
+                for (auto *Pred : llvm::predecessors(Preheader)) {
+                    if (isVectorizedLatch(*Pred)) {
+                        return false;
+                    }
+                    if (auto *Middle = Pred->getSinglePredecessor(); Middle && isVectorizedLatch(*Middle)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            return !LoopContainsMetadata(Loop, "llvm.loop.unroll.runtime.disable");
+        }
+
+        /**
+         * @brief ブロックがベクトル化されたループの latch であるか判定する
+         * @param Block 判定対象のブロック
+         * @return 終端命令に llvm.loop.isvectorized を含むループのメタデータが付いているか
+         */
+        bool isVectorizedLatch(const llvm::BasicBlock &Block)
+        {
+            auto *LoopID = Block.getTerminator() ? Block.getTerminator()->getMetadata(llvm::LLVMContext::MD_loop) : nullptr;
+            return LoopID && LoopIDContainsMetadata(*LoopID, "llvm.loop.isvectorized");
+        }
+
+        /**
+         * @brief ループのキャプチャされた変数の受け渡し方を決める
+         * @param Loop 対象のループ
+         * @return 受け渡し方
+         * @details ベクトル化されたループ本体はベクトル型の値をキャプチャすることが多く、これは va_list では渡せないため、
+         * @details abi によらず構造体渡しとする（並列に実行するループと同様）
+         */
+        CaptureABI getCaptureABI(const llvm::Loop &Loop)
+        {
+            if (abi == CaptureABI::VaList && LoopContainsMetadata(Loop, "llvm.loop.isvectorized") && isVectorBody(Loop)) {
+                return CaptureABI::Struct;
+            }
+            return abi;
+        }
+
+        /**
+         * @brief ループを extracted 関数で置換する
+         * @param Loop 置換対象のループ
+         * @param Plan 並列に実行する場合はその情報、そうでない場合は nullptr
+         * @param ORE ループを含む関数の OptimizationRemarkEmitter
+         * @return 置換が行われた場合はその結果
+         */
+        std::optional<Extraction> extractLoopIntoFunction(llvm::Loop &Loop, const ParallelPlan *Plan, llvm::OptimizationRemarkEmitter &ORE)
+        {
+            // IR を書き換える前に、変形できるループであるかを確かめる
+            // 並列に実行するループは、キャプチャされた変数を常に構造体にまとめて渡す
+            // （並列に実行するループは計画の段階で確かめてあるが、先に変形したループの影響を受けていないか確かめなおす）
+            auto ABI = Plan ? CaptureABI::Struct : getCaptureABI(Loop);
+            if (!isExtractable(Loop, ORE, ABI)) {
+                // preheader で求めておいた繰り返し回数は使われないため取り除く
+                if (Plan) {
+                    llvm::RecursivelyDeleteTriviallyDeadInstructions(Plan->TripCount);
+                }
+                return std::nullopt;
+            }
+            if (Plan) {
+                return Extraction{extractParallelLoop(Loop, *Plan), 1, true, ABI};
+            }
+            demoteLoopCarriedValues(Loop);
+
+            auto *Preheader = Loop.getLoopPreheader();
+            llvm::IRBuilder Builder(Preheader->getTerminator());
+
+            std::vector<llvm::Value *> Captures;
+            auto *Extracted = createExtracted(Loop, std::back_inserter(Captures), ABI);
+
+            std::vector<llvm::Value *> ArgsToLooper;
+            switch (ABI) {
+            case CaptureABI::VaList:
+                for (auto *Capture : Captures) {
+                    ArgsToLooper.push_back(promoteVaArg(Builder, Capture));
+                }
+                break;
+            case CaptureABI::Struct:
+                ArgsToLooper.push_back(packCaptures(Builder, Captures));
+                break;
+            }
+
+            // preheader の終端命令（この時点で exit ブロックへの branch に書き換えられている）の前に
+            // looper 関数の呼び出しを挿入する
+            if (looper_kind == LooperKind::Runtime) {
+                ArgsToLooper.insert(ArgsToLooper.begin(), Extracted);
+                Builder.CreateCall(getLooperFC(*Preheader->getModule(), ABI), llvm::ArrayRef(ArgsToLooper));
+            } else {
+                Builder.CreateCall(createSpecializedLooper(*Extracted, ABI), llvm::ArrayRef(ArgsToLooper));
+            }
+            return Extraction{static_cast<unsigned>(Captures.size()), 1, false, ABI};
+        }
+
+        /**
+         * @brief 入れ子になったループをまとめて一つの extracted 関数で置換する
+         * @param Outer 最も外側のループ
+         * @param Inner Outer に含まれる、まとめて置換するループの一覧
+         * @param ORE ループを含む関数の OptimizationRemarkEmitter
+         * @return 置換が行われた場合はその結果
+         * @details ループ群を、各ループの header のどれから再開するかを状態として持つ一つのループに平坦化してから置換する
+         * @details 平坦化したループの header は状態に応じて各 header に分岐し、各ループの back edge は状態を更新して共通の latch に合流する
+         * @details これにより、ループ群全体が一度の looper 関数の呼び出しで実行され、内側のループに入るたびに looper 関数が呼び出されることがなくなる
+         * @note Inner に含まれないループは、平坦化したループの中でそのままループとして実行される
+         */
+        std::optional<Extraction> extractLoopNest(llvm::Loop &Outer, llvm::ArrayRef<llvm::Loop *> Inner, llvm::OptimizationRemarkEmitter &ORE)
+        {
+            // IR を書き換える前に、変形できるループ群であるかを確かめる
+            if (!isExtractable(Outer, ORE, abi)) {
+                return std::nullopt;
+            }
+            if (!llvm::all_of(Inner, [](auto *Loop) { return Loop->isLoopSimplifyForm(); })) {
+                ORE.emit([&] {
+                    return llvm::OptimizationRemarkMissed(DEBUG_TYPE, "NestNotFlattened", Outer.getStartLoc(), Outer.getHeader())
+                        << "loop nest not flattened: inner loop is not simplified";
+                });
+                return extractLoopIntoFunction(Outer, nullptr, ORE);
+            }
+
+            // 各ループの header の PHI 命令は back edge が付け替えられる前に退避する
+            demoteLoopCarriedValues(Outer, Inner);
+
+            std::vector<llvm::Loop *> Members{&Outer};
+            Members.insert(Members.end(), Inner.begin(), Inner.end());
+            auto *Function = Outer.getHeader()->getParent();
+            auto &Context = Function->getContext();
+            auto *Int32 = llvm::Type::getInt32Ty(Context);
+            auto &Entry = Function->getEntryBlock();
+            auto *State = llvm::IRBuilder(&Entry, Entry.getFirstInsertionPt()).CreateAlloca(Int32);
+
+            auto *Dispatch = llvm::BasicBlock::Create(Context, "", Function);
+            auto *Latch = llvm::BasicBlock::Create(Context, "", Function);
+            llvm::IRBuilder(Latch).CreateBr(Dispatch);
+
+            // preheader からは最も外側のループの header から始める
+            auto *Preheader = Outer.getLoopPreheader();
+            llvm::IRBuilder(Preheader->getTerminator()).CreateStore(llvm::ConstantInt::get(Int32, 0), State);
+            Preheader->getTerminator()->setSuccessor(0, Dispatch);
+
+            // 各ループの back edge を、そのループの番号を状態に格納して共通の latch に向かう辺に置き換える
+            llvm::IRBuilder Builder(Dispatch);
+            auto *Switch = Builder.CreateSwitch(Builder.CreateLoad(Int32, State), Outer.getHeader(), Members.size() - 1);
+            for (unsigned Index = 0; Index < Members.size(); ++Index) {
+                auto *Header = Members[Index]->getHeader();
+                auto *Yield = llvm::BasicBlock::Create(Context, "", Function);
+                llvm::IRBuilder YieldBuilder(Yield);
+                YieldBuilder.CreateStore(llvm::ConstantInt::get(Int32, Index), State);
+                YieldBuilder.CreateBr(Latch);
+                Members[Index]->getLoopLatch()->getTerminator()->replaceSuccessorWith(Header, Yield);
+                if (Index) {
+                    Switch->addCase(llvm::ConstantInt::get(Int32, Index), Header);
+                }
+            }
+
+            // 平坦化したループを改めて解析し、状態から再開した際に定義を通らない値を退避したうえで置換する
+            llvm::DominatorTree DT(*Function);
+            llvm::LoopInfo LoopInfo(DT);
+            auto *Flat = LoopInfo.getLoopFor(Dispatch);
+            demoteUndominatedValues(Flat->getBlocks(), DT);
+            // 平坦化したループの exit ブロックや終端命令は元の最も外側のループのものと変わらないため、必ず置換できる
+            auto Result = extractLoopIntoFunction(*Flat, nullptr, ORE);
+            assert(Result && "flattened loop nest must be extractable");
+            Result->Loops = Members.size();
+            return Result;
+        }
+
+        /**
+         * @brief ループを並列に実行できるか調べる
+         * @param Loop 対象のループ
+         * @param SE 関数の ScalarEvolution
+         * @param ORE 関数の OptimizationRemarkEmitter
+         * @return 並列に実行できる場合はその情報
+         * @details llvm.loop.parallel_accesses によって各繰り返しが互いに独立であることが示されており、
+         * @details header の PHI 命令がすべて増分が定数の整数の帰納変数であり、繰り返し回数がループに入る前に求まり、
+         * @details ループの結果（exit ブロックの PHI 命令）を持たない場合のみ並列に実行できる
+         * @note このとき帰納変数の値は繰り返しの番号から直接求まるため、繰り返しをまたいで受け渡される状態は存在しない
+         * @note IR は変更しない（繰り返し回数は、変形が確定してから expandTripCount で求める）
+         */
+        std::optional<ParallelPlan> planParallel(llvm::Loop &Loop, llvm::ScalarEvolution &SE, llvm::OptimizationRemarkEmitter &ORE)
+        {
+            // 並列に実行できないループは通常通り難読化される
+            auto serial = [&](llvm::StringRef Name, llvm::StringRef Reason) {
+                ORE.emit([&] {
+                    return llvm::OptimizationRemarkMissed(DEBUG_TYPE, Name, Loop.getStartLoc(), Loop.getHeader())
+                        << "loop not parallelized: " << Reason;
+                });
+                return std::nullopt;
+            };
+            if (!Loop.isAnnotatedParallel()) {
+                return serial("NotParallelAnnotated", "loop is not annotated with llvm.loop.parallel_accesses");
+            }
+            if (llvm::isa<llvm::PHINode>(Loop.getUniqueExitBlock()->front())) {
+                return serial("ParallelResult", "loop has a result");
+            }
+
+            auto *BackedgeTakenCount = SE.getBackedgeTakenCount(&Loop);
+            if (llvm::isa<llvm::SCEVCouldNotCompute>(BackedgeTakenCount)) {
+                return serial("ParallelTripCountUnknown", "trip count is unknown");
+            }
+
+            ParallelPlan Plan{};
+            for (auto &&PHI : Loop.getHeader()->phis()) {
+                llvm::InductionDescriptor Induction;
+                if (!llvm::InductionDescriptor::isInductionPHI(&PHI, &Loop, &SE, Induction) ||
+                    Induction.getKind() != llvm::InductionDescriptor::IK_IntInduction ||
+                    !Induction.getConstIntStepValue()) {
+                    return serial("ParallelCarriedValue", "loop carries a value other than an integer induction variable");
+                }
+                Plan.Inductions.emplace_back(&PHI, Induction.getConstIntStepValue());
+            }
+
+            // 繰り返し回数は back edge を通る回数より一つ多い
+            auto *Preheader = Loop.getLoopPreheader();
+            auto *Int64 = llvm::Type::getInt64Ty(Preheader->getContext());
+            auto *TripCount = SE.getAddExpr(SE.getTruncateOrZeroExtend(BackedgeTakenCount, Int64), SE.getOne(Int64));
+            llvm::SCEVExpander Expander(SE, Preheader->getModule()->getDataLayout(), "lambdaize");
+            if (!Expander.isSafeToExpand(TripCount)) {
+                return serial("ParallelTripCountUnexpandable", "trip count cannot be expanded in the preheader");
+            }
+            Plan.TripCountExpr = TripCount;
+            return Plan;
+        }
+
+        /**
+         * @brief 並列に実行することが確定したループの繰り返し回数を preheader で求める
+         * @param Loop 対象のループ
+         * @param[in,out] Plan planParallel で求めたループの情報（求めた値を TripCount に記録する）
+         * @param SE 関数の ScalarEvolution（planParallel で用いたもの）
+         */
+        void expandTripCount(llvm::Loop &Loop, ParallelPlan &Plan, llvm::ScalarEvolution &SE)
+        {
+            auto *Preheader = Loop.getLoopPreheader();
+            llvm::SCEVExpander Expander(SE, Preheader->getModule()->getDataLayout(), "lambdaize");
+            Plan.TripCount = Expander.expandCodeFor(Plan.TripCountExpr, Plan.TripCountExpr->getType(), Preheader->getTerminator());
+        }
+
+        /**
+         * @brief 並列に実行できるループを、繰り返しの番号を受け取る extracted 関数で置換する
+         * @param Loop 置換対象のループ
+         * @param Plan planParallel で求めたループの情報
+         * @details extracted 関数は繰り返しを一回だけ行い、帰納変数の値は初期値に繰り返しの番号と増分の積を足して求める
+         * @details 呼び出し元は looper_parallel 関数に extracted 関数と繰り返し回数を渡し、スレッドプールで実行させる
+         * @return extracted 関数に渡される変数の数
+         * @note キャプチャされた変数は各スレッドから読み出されるだけなので、常に構造体にまとめて渡す
+         */
+        unsigned extractParallelLoop(llvm::Loop &Loop, const ParallelPlan &Plan)
+        {
+            auto *Preheader = Loop.getLoopPreheader();
+            auto *Header = Loop.getHeader();
+            llvm::IRBuilder Builder(Preheader->getTerminator());
+
+            std::vector<llvm::Value *> Captures;
+            auto *Extracted = createExtracted(Loop, std::back_inserter(Captures), CaptureABI::Struct, true /* parallel */);
+
+            // 帰納変数の初期値は、キャプチャされた変数に置き換えられた preheader からの値である
+            llvm::IRBuilder BodyBuilder(Header, Header->getFirstInsertionPt());
+            for (auto [PHI, Step] : Plan.Inductions) {
+                auto *Index = BodyBuilder.CreateZExtOrTrunc(Extracted->getArg(1), PHI->getType());
+                auto *Start = PHI->getIncomingValueForBlock(Preheader);
+                PHI->replaceAllUsesWith(BodyBuilder.CreateAdd(Start, BodyBuilder.CreateMul(Index, Step)));
+                PHI->eraseFromParent();
+            }
+
+            Builder.CreateCall(
+                getParallelLooperFC(*Preheader->getModule()),
+                {Extracted, packCaptures(Builder, Captures), Plan.TripCount});
+            return Captures.size();
+        }
+
+        /**
+         * @brief ループが extracted 関数に変形できるか判定する
+         * @param Loop 判定対象のループ
+         * @param ORE ループを含む関数の OptimizationRemarkEmitter（変形できない理由を報告する）
+         * @param ABI キャプチャされた変数の受け渡し方（並列に実行するループでは abi によらず構造体渡しとなる）
+         * @return 変形できるか否か
+         * @note exit ブロックをちょうど一つ持ち、内部の終端命令が全て branch 命令か switch 命令であり、
+         * @note ループ内で定義された値がループの外では exit ブロックの PHI 命令からのみ使用されている（LCSSA 形式である）場合のみ変形できる
+         * @note va_list 渡しの場合は、キャプチャされる値がすべて可変長引数として渡せる型である必要がある
+         */
+        bool isExtractable(const llvm::Loop &Loop, llvm::OptimizationRemarkEmitter &ORE, CaptureABI ABI)
+        {
+            auto reject = [&](llvm::StringRef Name, llvm::StringRef Reason) {
+                ORE.emit([&] { return missed(Name, Loop) << Reason; });
+                return false;
+            };
+            if (!Loop.isLoopSimplifyForm()) {
+                return reject("NotSimplified", "loop is not in simplified form");
+            }
+
+            // exit block がちょうど一つでない場合は対象外
+            auto *Exit = Loop.getUniqueExitBlock();
+            if (!Exit) {
+                return reject("MultipleExits", "loop has multiple exit blocks");
+            }
+
+            for (auto *Block : Loop.blocks()) {
+                // 終端命令が branch でも switch でもない場合（例外を投げる場合など）は対象外
+                if (!llvm::BranchInst::classof(Block->getTerminator()) &&
+                    !llvm::SwitchInst::classof(Block->getTerminator())) {
+                    return reject("UnsupportedTerminator", "terminator is neither branch nor switch");
+                }
+
+                for (auto &&Inst : *Block) {
+                    // ループ内で定義された値がループの外で直接使用されている場合は対象外
+                    for (auto *User : Inst.users()) {
+                        auto *UserBlock = llvm::cast<llvm::Instruction>(User)->getParent();
+                        if (!Loop.contains(UserBlock) && !(UserBlock == Exit && llvm::isa<llvm::PHINode>(User))) {
+                            return reject("NotLCSSA", "loop is not in LCSSA form");
+                        }
+                    }
+
+                    // va_list 渡しの場合、ループの外で定義された値の型を確かめる
+                    // ただし header の PHI 命令に preheader から渡される値は extracted 関数には渡されない
+                    if (ABI != CaptureABI::VaList) {
+                        continue;
+                    }
+                    auto *PHI = llvm::dyn_cast<llvm::PHINode>(&Inst);
+                    for (unsigned Index = 0; Index < Inst.getNumOperands(); ++Index) {
+                        if (PHI && !Loop.contains(PHI->getIncomingBlock(Index))) {
+                            continue;
+                        }
+                        auto *Op = Inst.getOperand(Index);
+                        if (isDefinedOutside(Loop, Op) && !isVaArgCompatible(Op->getType())) {
+                            return reject("VaArgIncompatible", "captured value cannot be passed through va_list");
+                        }
+                    }
+                }
+            }
+
+            // 退避される PHI 命令の値は token 型であってはならず、exit ブロックの PHI 命令に渡される値もキャプチャされうる
+            for (auto *Block : {Loop.getHeader(), Exit}) {
+                for (auto &&PHI : Block->phis()) {
+                    if (PHI.getType()->isTokenTy()) {
+                        return reject("TokenCarried", "token value is carried");
+                    }
+                    if (Block != Exit || ABI != CaptureABI::VaList) {
+                        continue;
+                    }
+                    for (auto &&Incoming : PHI.incoming_values()) {
+                        if (isDefinedOutside(Loop, Incoming.get()) && !isVaArgCompatible(Incoming->getType())) {
+                            return reject("VaArgIncompatible", "captured value cannot be passed through va_list");
+                        }
+                    }
+                }
+            }
+            return true;
+        }
 
-    std::mt19937_64 engine(std::random_device{}());
-    std::uniform_real_distribution<> dist(0., 1.);
+        /**
+         * @brief 値がループの外で定義された非グローバル変数であるか判定する
+         * @param Loop 判定対象のループ
+         * @param Value 判定対象の値
+         * @return ループの外で定義された引数か命令であるか
+         */
+        bool isDefinedOutside(const llvm::Loop &Loop, const llvm::Value *Value)
+        {
+            if (auto *Inst = llvm::dyn_cast<llvm::Instruction>(Value)) {
+                return !Loop.contains(Inst);
+            }
+            return llvm::isa<llvm::Argument>(Value);
+        }
 
-    /**
-     * @brief LambdaizeLoop パスの実装
-     */
-    class LambdaizeLoop : public llvm::PassInfoMixin<LambdaizeLoop> {
-    public:
         /**
-         * @brief パスの処理の実体
-         * @note lambdaizeloop メタデータを持つループのみ処理を行う
+         * @brief 型が可変長引数として渡せるか判定する
+         * @param Type 判定対象の型
+         * @return 64 bit 以下の整数型、ポインタ型、half 型、float 型、double 型のいずれかであるか
          */
-        llvm::PreservedAnalyses run(llvm::Function &Function, llvm::FunctionAnalysisManager &FAM)
+        bool isVaArgCompatible(llvm::Type *Type)
         {
-            auto &LoopInfo = FAM.getResult<llvm::LoopAnalysis>(Function);
-            bool Changed = false;
-            for (auto *Loop : LoopInfo.getLoopsInPreorder()) {
-                if (!Loop->isLoopSimplifyForm()) {
-                    LLVM_DEBUG(llvm::dbgs() << "Loop is not simplified.\n");
-                    continue;
-                }
-                if (!all && !LoopContainsMetadata(*Loop, "lambdaizeloop")) {
-                    LLVM_DEBUG(llvm::dbgs() << "\"lambdaizeloop\" metadata is not set.\n";);
-                    continue;
+            return (Type->isIntegerTy() && Type->getIntegerBitWidth() <= 64) ||
+                   Type->isPointerTy() || Type->isHalfTy() || Type->isFloatTy() || Type->isDoubleTy();
+        }
+
+        /**
+         * @brief 可変長引数として渡す際の型を求める
+         * @param Type 元の型
+         * @return C の既定の実引数拡張と同様に、32 bit 未満の整数型は i32 に、double 型未満の浮動小数点型は double 型に拡張した型
+         */
+        llvm::Type *getVaArgType(llvm::Type *Type)
+        {
+            if (Type->isIntegerTy() && Type->getIntegerBitWidth() < 32) {
+                return llvm::Type::getInt32Ty(Type->getContext());
+            }
+            if (Type->isHalfTy() || Type->isFloatTy()) {
+                return llvm::Type::getDoubleTy(Type->getContext());
+            }
+            return Type;
+        }
+
+        /**
+         * @brief 値を可変長引数として渡す型に拡張する
+         * @param Builder 拡張命令の挿入位置を指す IRBuilder
+         * @param Value 拡張する値
+         * @return 拡張された値
+         */
+        llvm::Value *promoteVaArg(llvm::IRBuilder<> &Builder, llvm::Value *Value)
+        {
+            auto *Type = getVaArgType(Value->getType());
+            if (Type == Value->getType()) {
+                return Value;
+            }
+            return Type->isIntegerTy() ? Builder.CreateZExt(Value, Type) : Builder.CreateFPExt(Value, Type);
+        }
+
+        /**
+         * @brief 可変長引数として受け取った値を元の型に戻す
+         * @param Builder 変換命令の挿入位置を指す IRBuilder
+         * @param Value 可変長引数として受け取った値
+         * @param Type 元の型
+         * @return 元の型に戻された値
+         */
+        llvm::Value *demoteVaArg(llvm::IRBuilder<> &Builder, llvm::Value *Value, llvm::Type *Type)
+        {
+            if (Type == Value->getType()) {
+                return Value;
+            }
+            return Type->isIntegerTy() ? Builder.CreateTrunc(Value, Type) : Builder.CreateFPTrunc(Value, Type);
+        }
+
+        /**
+         * @brief ループの繰り返しをまたいで受け渡される SSA 値をメモリ上の状態に退避する
+         * @param Loop 対象のループ
+         * @param Inner Loop とまとめて置換する内側のループの一覧（これらの header の PHI 命令も退避する）
+         * @details header の PHI 命令（繰り返しごとに更新される値）と exit ブロックの PHI 命令（ループの結果）を、
+         * @details 関数の entry ブロックで確保した一つの構造体のメンバに置き換える
+         * @details 各 PHI 命令に入ってくる値はその辺の始点のブロックの終端で格納し、PHI 命令があった場所で読み出す
+         * @details 構造体へのポインタはキャプチャされた変数として extracted 関数に渡されるため、
+         * @details extracted 関数は繰り返しのたびにこの状態を更新し、呼び出し元はループの終了後に結果を読み出すことになる
+         * @note -O0 で生成された IR のように状態がすべてメモリ上にある場合は何もしない
+         */
+        void demoteLoopCarriedValues(llvm::Loop &Loop, llvm::ArrayRef<llvm::Loop *> Inner = {})
+        {
+            auto *Header = Loop.getHeader();
+            std::vector<llvm::BasicBlock *> Blocks{Header, Loop.getUniqueExitBlock()};
+            for (auto *InnerLoop : Inner) {
+                Blocks.push_back(InnerLoop->getHeader());
+            }
+            std::vector<llvm::PHINode *> PHIs;
+            for (auto *Block : Blocks) {
+                for (auto &&PHI : Block->phis()) {
+                    PHIs.push_back(&PHI);
                 }
-                if (dist(engine) >= probability) {
-                    continue;
+            }
+            if (PHIs.empty()) {
+                return;
+            }
+
+            std::vector<llvm::Type *> Types;
+            for (auto *PHI : PHIs) {
+                Types.push_back(PHI->getType());
+            }
+            auto *StateType = llvm::StructType::get(Header->getContext(), Types);
+            auto &Entry = Header->getParent()->getEntryBlock();
+            auto *State = llvm::IRBuilder(&Entry, Entry.getFirstInsertionPt()).CreateAlloca(StateType);
+
+            // header の PHI 命令を先に置き換えるため、exit ブロックの PHI 命令に渡される header の PHI 命令も読み出した値に置き換わる
+            for (unsigned Index = 0; Index < PHIs.size(); ++Index) {
+                auto *PHI = PHIs[Index];
+                for (unsigned Incoming = 0; Incoming < PHI->getNumIncomingValues(); ++Incoming) {
+                    llvm::IRBuilder Builder(PHI->getIncomingBlock(Incoming)->getTerminator());
+                    Builder.CreateStore(PHI->getIncomingValue(Incoming), Builder.CreateStructGEP(StateType, State, Index));
                 }
-                Changed |= extractLoopIntoFunction(*Loop);
+
+                auto *Block = PHI->getParent();
+                llvm::IRBuilder Builder(Block, Block->getFirstInsertionPt());
+                PHI->replaceAllUsesWith(Builder.CreateLoad(PHI->getType(), Builder.CreateStructGEP(StateType, State, Index)));
+                PHI->eraseFromParent();
             }
-            return Changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
         }
 
-    private:
         /**
-         * @brief 指定の文字列がループメタデータに含まれるか判定する
-         * @param Loop 判定対象のループ
-         * @param Str 判定対象の文字列
-         * @return Loop のメタデータ内に Str が含まれるか
+         * @brief 定義に支配されない場所で使用されている値をメモリ上の状態に退避する
+         * @param Blocks 対象のブロック群
+         * @param DT Blocks を含む関数の DominatorTree
+         * @details 退避する値は関数の entry ブロックで確保した一つの構造体のメンバに、定義の直後で格納し、
+         * @details 定義に支配されない使用箇所の直前（PHI 命令の場合はその辺の始点のブロックの終端）で読み出す
+         * @note 定義に支配される使用箇所はそのまま SSA 値を用いる
          */
-        bool LoopContainsMetadata(const llvm::Loop &Loop, const llvm::StringRef Str)
+        void demoteUndominatedValues(llvm::ArrayRef<llvm::BasicBlock *> Blocks, llvm::DominatorTree &DT)
         {
-            // "For legacy reasons, the first item of a loop metadata node must be a reference to itself."
-            // see https://llvm.org/docs/LangRef.html#llvm-loop
+            std::vector<llvm::Instruction *> Values;
+            for (auto *Block : Blocks) {
+                for (auto &&Inst : *Block) {
+                    if (llvm::any_of(Inst.uses(), [&](const llvm::Use &Use) { return !DT.dominates(&Inst, Use); })) {
+                        Values.push_back(&Inst);
+                    }
+                }
+            }
+            if (Values.empty()) {
+                return;
+            }
 
-            if (auto *LoopID = Loop.getLoopID()) {
-                // TODO: replace with std:: when C++20 is available.
-                return llvm::any_of(
-                    LoopID->operands().drop_front(),
-                    [Str](const auto &MDOperand) {
-                        const auto Metadata = llvm::cast<llvm::MDNode>(MDOperand.get());
-                        return Metadata->getOperand(0).equalsStr(Str);
-                    });
+            std::vector<llvm::Type *> Types;
+            for (auto *Value : Values) {
+                Types.push_back(Value->getType());
+            }
+            auto *Function = Blocks.front()->getParent();
+            auto *StateType = llvm::StructType::get(Function->getContext(), Types);
+            auto &Entry = Function->getEntryBlock();
+            auto *State = llvm::IRBuilder(&Entry, Entry.getFirstInsertionPt()).CreateAlloca(StateType);
+
+            for (unsigned Index = 0; Index < Values.size(); ++Index) {
+                auto *Value = Values[Index];
+                std::vector<llvm::Use *> Undominated;
+                for (auto &&Use : Value->uses()) {
+                    if (!DT.dominates(Value, Use)) {
+                        Undominated.push_back(&Use);
+                    }
+                }
+
+                auto *Block = Value->getParent();
+                llvm::IRBuilder Builder(Block, llvm::isa<llvm::PHINode>(Value) ? Block->getFirstInsertionPt() : std::next(Value->getIterator()));
+                Builder.CreateStore(Value, Builder.CreateStructGEP(StateType, State, Index));
+
+                for (auto *Use : Undominated) {
+                    auto *User = llvm::cast<llvm::Instruction>(Use->getUser());
+                    if (auto *PHI = llvm::dyn_cast<llvm::PHINode>(User)) {
+                        User = PHI->getIncomingBlock(*Use)->getTerminator();
+                    }
+                    llvm::IRBuilder Builder(User);
+                    Use->set(Builder.CreateLoad(Value->getType(), Builder.CreateStructGEP(StateType, State, Index)));
+                }
             }
-            return false;
         }
 
         /**
-         * @brief ループを extracted 関数で置換する
-         * @param Loop 置換対象のループ
-         * @return 置換が行われたか否か
+         * @brief キャプチャされた変数を構造体に詰める
+         * @param Builder 格納命令の挿入位置を指す IRBuilder
+         * @param Captures キャプチャされた変数の一覧
+         * @return 変数を詰めた構造体へのポインタ
+         * @note 構造体の領域は関数の entry ブロックで確保するため、ループ内でスタックが伸びることはない
          */
-        bool extractLoopIntoFunction(llvm::Loop &Loop)
+        llvm::Value *packCaptures(llvm::IRBuilder<> &Builder, llvm::ArrayRef<llvm::Value *> Captures)
         {
-            auto *Preheader = Loop.getLoopPreheader();
-            llvm::IRBuilder Builder(Preheader->getTerminator());
+            auto *Function = Builder.GetInsertBlock()->getParent();
+            auto *CaptureType = getCaptureStructType(Function->getContext(), Captures);
 
-            // HACK: ArgsToLooper[0] should contain pointer to Extracted, so reserve place
-            std::vector<llvm::Value *> ArgsToLooper(1);
-            if ((ArgsToLooper[0] = createExtracted(Loop, std::back_inserter(ArgsToLooper)))) {
-                // preheader の終端命令（この時点で exit ブロックへの branch に書き換えられている）の前に
-                // looper 関数の呼び出しを挿入する
-                Builder.CreateCall(getLooperFC(*Preheader->getModule()), llvm::ArrayRef(ArgsToLooper));
-                return true;
+            auto &Entry = Function->getEntryBlock();
+            auto *Alloca = llvm::IRBuilder(&Entry, Entry.getFirstInsertionPt()).CreateAlloca(CaptureType);
+            for (unsigned Index = 0; Index < Captures.size(); ++Index) {
+                Builder.CreateStore(Captures[Index], Builder.CreateStructGEP(CaptureType, Alloca, Index));
             }
-
-            return false;
+            return Alloca;
         }
 
         /**
@@ -102,39 +1480,65 @@ namespace {
          * @brief さらに作成された extracted 関数に渡される必要がある変数の一覧を取得する
          * @param Loop 変形対象のループ
          * @param[out] NeededArguments Value* への出力イテレータ
-         * @return extracted 関数が作成された場合はそのポインタ
-         * @return 作成されなかった場合は nullptr
+         * @param ABI キャプチャされた変数の受け渡し方（Parallel の場合は構造体渡しでなければならない）
+         * @param Parallel 繰り返しの番号を受け取る、並列実行用の extracted 関数を作成するか
+         * @return 作成された extracted 関数
+         * @pre Loop は isExtractable を満たし、demoteLoopCarriedValues によって PHI 命令が退避されている
+         * @pre Parallel の場合は、header の PHI 命令は退避されずに残っており、呼び出し元で置き換えられる
          */
         template <class OutputIterator>
-        llvm::Function *createExtracted(llvm::Loop &Loop, OutputIterator NeededArguments)
+        llvm::Function *createExtracted(llvm::Loop &Loop, OutputIterator NeededArguments, CaptureABI ABI, bool Parallel = false)
         {
             auto *Module = Loop.getHeader()->getModule();
             auto &Context = Loop.getHeader()->getContext();
 
             // ループを構成するブロック群を除外する
             std::vector<llvm::BasicBlock *> BlocksFromLoop;
-            if (!removeLoop(Loop, std::back_inserter(BlocksFromLoop))) {
-                return nullptr;
-            }
+            removeLoop(Loop, std::back_inserter(BlocksFromLoop));
 
             // ループ内で使用されている変数のうち、外部で宣言されている者の一覧を取得する
             std::vector<llvm::Value *> OutsideDefined;
             setOutsideDefinedVariables(BlocksFromLoop.begin(), BlocksFromLoop.end(), std::back_inserter(OutsideDefined));
             llvm::copy(OutsideDefined, NeededArguments); // TODO: replace with std:: when C++20 is available.
 
+            // private ではなく internal とし、実行ファイルの局所シンボルとして名前を残す（plot-instdist などで区別できるようにする）
             auto *Extracted = llvm::Function::Create(
-                getExtractedFunctionType(Context),
-                llvm::GlobalValue::LinkageTypes::PrivateLinkage,
+                Parallel ? getParallelBodyType(Context) : getExtractedFunctionType(Context, ABI),
+                llvm::GlobalValue::LinkageTypes::InternalLinkage,
                 "extracted",
                 *Module);
 
+            // MergeExtracted パスなどが extracted 関数を名前によらず見分けられるようにする
+            Extracted->addFnAttr(ExtractedAttribute);
+
             llvm::IRBuilder Builder(llvm::BasicBlock::Create(Context, "", Extracted));
 
-            // extracted 関数の先頭で va_list の中身をすべて取り出す命令を挿入し、
+            // extracted 関数の先頭でキャプチャされた変数をすべて取り出す命令を挿入し、
             // 取り出された変数とアドレスの対応を記録する
-            std::map<llvm::Value *, llvm::Value *> ArgAddrMap;
-            for (auto *OD : OutsideDefined) {
-                ArgAddrMap[OD] = Builder.CreateVAArg(Extracted->getArg(0), OD->getType());
+            llvm::DenseMap<llvm::Value *, llvm::Value *> ArgAddrMap;
+            switch (ABI) {
+            case CaptureABI::VaList:
+                for (auto *OD : OutsideDefined) {
+                    auto *Arg = Builder.CreateVAArg(Extracted->getArg(0), getVaArgType(OD->getType()));
+                    ArgAddrMap[OD] = demoteVaArg(Builder, Arg, OD->getType());
+                }
+                break;
+            case CaptureABI::Struct: {
+                auto *CaptureType = getCaptureStructType(Context, OutsideDefined);
+                for (unsigned Index = 0; Index < OutsideDefined.size(); ++Index) {
+                    auto *OD = OutsideDefined[Index];
+                    auto *Addr = Builder.CreateStructGEP(CaptureType, Extracted->getArg(0), Index);
+                    ArgAddrMap[OD] = Builder.CreateLoad(OD->getType(), Addr);
+                }
+                break;
+            }
+            }
+
+            // 一度の呼び出しで複数回繰り返す場合は、繰り返し回数を数えるカウンタを用意する
+            llvm::AllocaInst *BatchCounter = nullptr;
+            if (batch > 1 && !Parallel) {
+                BatchCounter = Builder.CreateAlloca(Builder.getInt32Ty());
+                Builder.CreateStore(Builder.getInt32(0), BatchCounter);
             }
 
             // ループから取り出されたブロック群の先頭に branch する
@@ -146,44 +1550,54 @@ namespace {
             for (auto *Block : BlocksFromLoop) {
                 for (auto &&Inst : *Block) {
                     for (auto &&Op : Inst.operands()) {
-                        if (ArgAddrMap.count(Op)) {
-                            Op = ArgAddrMap[Op];
+                        if (auto *Addr = ArgAddrMap.lookup(Op)) {
+                            Op = Addr;
                         }
                     }
                 }
                 Block->insertInto(Extracted);
             }
 
+            if (BatchCounter) {
+                // removeLoop の出力の末尾から二番目は LoopContinue ブロックである
+                stripMine(*BlocksFromLoop[BlocksFromLoop.size() - 2], *BlocksFromLoop.front(), *BatchCounter);
+                // count-cyclomatic-complexity などがコストの見積もりで按分できるよう、繰り返しの回数を記録する
+                Extracted->addFnAttr(BatchAttribute, llvm::utostr(batch));
+            }
+
             return Extracted;
         }
 
         /**
-         * @brief 変形条件を満たすループ（を構成する basic block 群）を除外したうえで出力する
+         * @brief extracted 関数が一度の呼び出しで batch 回だけ繰り返しを行うようにする
+         * @param LoopContinue ループが継続される場合に到達するブロック
+         * @param Header ループの先頭ブロック
+         * @param Counter この呼び出しで行った繰り返しの回数を保持する領域
+         * @details LoopContinue に到達するたびに Counter を増やし、batch 回に達するまでは
+         * @details looper 関数に戻らずに Header へ直接 branch する
+         */
+        void stripMine(llvm::BasicBlock &LoopContinue, llvm::BasicBlock &Header, llvm::AllocaInst &Counter)
+        {
+            auto *Yield = llvm::BasicBlock::Create(LoopContinue.getContext(), "", LoopContinue.getParent());
+            llvm::IRBuilder(Yield).CreateRet(llvm::ConstantInt::getTrue(LoopContinue.getContext()));
+
+            LoopContinue.getTerminator()->eraseFromParent();
+            llvm::IRBuilder Builder(&LoopContinue);
+            auto *Count = Builder.CreateAdd(Builder.CreateLoad(Builder.getInt32Ty(), &Counter), Builder.getInt32(1));
+            Builder.CreateStore(Count, &Counter);
+            Builder.CreateCondBr(Builder.CreateICmpULT(Count, Builder.getInt32(batch)), &Header, Yield);
+        }
+
+        /**
+         * @brief ループ（を構成する basic block 群）を除外したうえで出力する
          * @param[in] Loop 変形するループ
          * @param[out] Dest BasicBlock* への出力イテレータ
-         * @return 変形が行われたか否か
-         * @note exit ブロックをちょうど一つ持ち、なおかつ内部の終端命令が全て
-         * @note branch 命令か switch 命令である場合のみ変形を行う
+         * @pre Loop は isExtractable を満たす
          */
         template <class OutputIterator>
-        bool removeLoop(llvm::Loop &Loop, OutputIterator Dest)
+        void removeLoop(llvm::Loop &Loop, OutputIterator Dest)
         {
-            auto *OriginalHeader = Loop.getHeader(), *OriginalExit = Loop.getExitBlock();
-
-            // exit block がちょうど一つでない場合は対象外
-            if (!OriginalExit) {
-                LLVM_DEBUG(llvm::dbgs() << "multiple exit blocks. skipped.\n";);
-                return false;
-            }
-
-            // 終端命令が branch でも switch でもない場合（例外を投げる場合など）は対象外
-            for (auto *Block : Loop.blocks()) {
-                if (!llvm::BranchInst::classof(Block->getTerminator()) &&
-                    !llvm::SwitchInst::classof(Block->getTerminator())) {
-                    LLVM_DEBUG(llvm::dbgs() << "terminator is neither branch or switch. skipped.\n";);
-                    return false;
-                }
-            }
+            auto *OriginalHeader = Loop.getHeader(), *OriginalExit = Loop.getUniqueExitBlock();
 
             auto &Context = Loop.getHeader()->getContext();
 
@@ -196,7 +1610,7 @@ namespace {
             llvm::IRBuilder(LoopBreak).CreateRet(llvm::ConstantInt::getFalse(Context));
 
             // preheader の（唯一の）後継ブロックを exit ブロックに書き換え、ループを閉じる
-            Loop.getLoopPreheader()->getTerminator()->setSuccessor(0, Loop.getExitBlock());
+            Loop.getLoopPreheader()->getTerminator()->setSuccessor(0, Loop.getUniqueExitBlock());
 
             // ループ内のすべてのブロックに対し back edge と exit edge の行き先を書き換えつつ、
             // 「除外リスト」に追加していく
@@ -208,21 +1622,23 @@ namespace {
                 ToBeRemoved.push_back(Block);
             }
 
-            // 「除外リスト」内のすべてのブロックをループ内から削除し、
+            // 「除外リスト」内のすべてのブロックをループとその外側のループから削除する
+            // ブロックを一つずつ removeBlockFromLoop で削除するとループの大きさの二乗の時間がかかるため、まとめて削除する
+            llvm::SmallPtrSet<llvm::BasicBlock *, 32> Removed(ToBeRemoved.begin(), ToBeRemoved.end());
+            for (auto *LoopPtr = &Loop; LoopPtr; LoopPtr = LoopPtr->getParentLoop()) {
+                llvm::erase_if(LoopPtr->getBlocksVector(), [&Removed](auto *Block) { return Removed.count(Block); });
+                for (auto *Block : ToBeRemoved) {
+                    LoopPtr->getBlocksSet().erase(Block);
+                }
+            }
+
             // LoopContinue と LoopBreak とともに最終出力に追加する
             for (auto *Block : ToBeRemoved) {
                 Block->removeFromParent();
-                for (auto *LoopPtr = &Loop; LoopPtr; LoopPtr = LoopPtr->getParentLoop()) {
-                    if (LoopPtr->contains(Block)) {
-                        LoopPtr->removeBlockFromLoop(Block);
-                    }
-                }
                 *Dest++ = Block;
             }
             *Dest++ = LoopContinue;
             *Dest++ = LoopBreak;
-
-            return true;
         }
 
         /**
@@ -231,65 +1647,324 @@ namespace {
          * @param[in] last BasicBlock* のリストへの終点イテレータ
          * @param[out] result Value* への出力イテレータ
          * @return 書き込まれた範囲の終点イテレータ
+         * @note 変数は最初に使用された順に出力される
+         * @note 命令がブロック群の中で宣言されているかはその親ブロックで判定するため、命令数に対して線形時間で動作する
          */
         template <class InputIterator, class OutputIterator>
         OutputIterator setOutsideDefinedVariables(InputIterator first, InputIterator last, OutputIterator result)
         {
-            // ブロック内で宣言された変数の一覧
-            std::set<llvm::Value *> Declared;
+            // 変数を宣言しうるブロックの一覧
+            llvm::SmallPtrSet<const llvm::BasicBlock *, 32> Blocks(first, last);
 
-            // ブロック内で使用されている引数の一覧
-            std::set<llvm::Value *> Arguments;
+            // ブロック内で使用されている引数であって、宣言はされていないものの一覧
+            llvm::SmallSetVector<llvm::Value *, 16> Arguments;
             for (auto itr = first; itr != last; ++itr) {
                 for (auto &&Inst : **itr) {
-                    Declared.insert(&Inst);
                     for (auto *Op : Inst.operand_values()) {
                         // ラベルでも定数でもない非グローバル変数のみを追加する
-                        if (!Op->getType()->isLabelTy() &&
-                            !llvm::isa<llvm::GlobalValue>(Op) &&
-                            !llvm::isa<llvm::Constant>(Op)) {
-                            Arguments.insert(Op);
+                        if (Op->getType()->isLabelTy() ||
+                            llvm::isa<llvm::GlobalValue>(Op) ||
+                            llvm::isa<llvm::Constant>(Op)) {
+                            continue;
                         }
+                        if (auto *OpInst = llvm::dyn_cast<llvm::Instruction>(Op); OpInst && Blocks.count(OpInst->getParent())) {
+                            continue;
+                        }
+                        Arguments.insert(Op);
                     }
                 }
             }
-
-            // ブロック内で使用されている引数であって、宣言はされていないものを取得する
-            return std::set_difference(
-                Arguments.begin(), Arguments.end(),
-                Declared.begin(), Declared.end(),
-                result);
+            return llvm::copy(Arguments, result); // TODO: replace with std:: when C++20 is available.
         }
 
         /**
          * @brief looper 関数の FunctionCallee を作成する
-         * @details looper 関数は extracted 関数へのポインタと可変長引数を受け取る
+         * @details va_list 渡しの場合、looper 関数は extracted 関数へのポインタと可変長引数を受け取る
+         * @details 構造体渡しの場合、looper_struct 関数は extracted 関数へのポインタと構造体へのポインタを受け取る
+         * @param ABI キャプチャされた変数の受け渡し方
          * @return looper 関数の FunctionCallee
          */
-        llvm::FunctionCallee getLooperFC(llvm::Module &Module)
+        llvm::FunctionCallee getLooperFC(llvm::Module &Module, CaptureABI ABI)
+        {
+            auto &Context = Module.getContext();
+            auto *ExtractedPtrType = getExtractedFunctionType(Context, ABI)->getPointerTo();
+            switch (ABI) {
+            case CaptureABI::VaList:
+                return Module.getOrInsertFunction(
+                    "looper",
+                    llvm::FunctionType::get(
+                        llvm::Type::getVoidTy(Context),
+                        llvm::ArrayRef<llvm::Type *>{ExtractedPtrType},
+                        true /* variadic */));
+            case CaptureABI::Struct:
+                return Module.getOrInsertFunction(
+                    "looper_struct",
+                    llvm::FunctionType::get(
+                        llvm::Type::getVoidTy(Context),
+                        llvm::ArrayRef<llvm::Type *>{ExtractedPtrType, llvm::Type::getInt8PtrTy(Context)},
+                        false /* NOT variadic */));
+            }
+            llvm_unreachable("unknown capture ABI");
+        }
+
+        /**
+         * @brief looper_parallel 関数の FunctionCallee を作成する
+         * @details looper_parallel 関数は並列実行用の extracted 関数へのポインタ、構造体へのポインタと繰り返し回数を受け取る
+         * @return looper_parallel 関数の FunctionCallee
+         */
+        llvm::FunctionCallee getParallelLooperFC(llvm::Module &Module)
         {
             auto &Context = Module.getContext();
             return Module.getOrInsertFunction(
-                "looper",
+                "looper_parallel",
+                llvm::FunctionType::get(
+                    llvm::Type::getVoidTy(Context),
+                    llvm::ArrayRef<llvm::Type *>{
+                        getParallelBodyType(Context)->getPointerTo(),
+                        llvm::Type::getInt8PtrTy(Context),
+                        llvm::Type::getInt64Ty(Context)},
+                    false /* NOT variadic */));
+        }
+
+        /**
+         * @brief extracted 関数専用の looper 関数を合成する
+         * @param Extracted 繰り返し対象の extracted 関数
+         * @param ABI キャプチャされた変数の受け渡し方（Extracted を作成した際のもの）
+         * @return 合成された looper 関数
+         * @details 合成される looper 関数は、va_list 渡しの場合は可変長引数を、
+         * @details 構造体渡しの場合はキャプチャ構造体へのポインタを受け取る
+         * @note 呼び出し先が定数になるため間接呼び出しが発生せず、inline 展開などの最適化も可能になる
+         */
+        llvm::Function *createSpecializedLooper(llvm::Function &Extracted, CaptureABI ABI)
+        {
+            auto &Context = Extracted.getContext();
+            auto *LooperType = ABI == CaptureABI::VaList
+                                   ? llvm::FunctionType::get(llvm::Type::getVoidTy(Context), true /* variadic */)
+                                   : llvm::FunctionType::get(
+                                         llvm::Type::getVoidTy(Context),
+                                         llvm::ArrayRef<llvm::Type *>{llvm::Type::getInt8PtrTy(Context)},
+                                         false /* NOT variadic */);
+            auto *Looper = llvm::Function::Create(
+                LooperType,
+                llvm::GlobalValue::LinkageTypes::InternalLinkage,
+                Extracted.getName() + ".looper",
+                Extracted.getParent());
+            Looper->addFnAttr(LooperAttribute);
+
+            llvm::IRBuilder Builder(llvm::BasicBlock::Create(Context, "", Looper));
+
+            // extracted 関数に渡す va_list もしくはキャプチャ構造体へのポインタ
+            llvm::Value *Args = nullptr;
+            switch (ABI) {
+            case CaptureABI::VaList:
+                Args = Builder.CreateAlloca(getVaListType(Context));
+                Builder.CreateIntrinsic(llvm::Intrinsic::vastart, {}, {Args});
+                break;
+            case CaptureABI::Struct:
+                Args = Looper->getArg(0);
+                break;
+            }
+
+            switch (looper_kind) {
+            case LooperKind::While:
+                emitWhileLoop(Builder, Extracted, Args, ABI);
+                break;
+            case LooperKind::Recursive:
+                Builder.CreateCall(createRecursiveLooper(Extracted, ABI), {Args, Builder.getInt32(0)});
+                break;
+            case LooperKind::TailRecursive:
+                Builder.CreateCall(createTailRecursiveLooper(Extracted, ABI), {Args});
+                break;
+            case LooperKind::Runtime:
+                llvm_unreachable("runtime looper cannot be synthesized");
+            }
+
+            if (ABI == CaptureABI::VaList) {
+                Builder.CreateIntrinsic(llvm::Intrinsic::vaend, {}, {Args});
+            }
+            Builder.CreateRetVoid();
+            return Looper;
+        }
+
+        /**
+         * @brief 再帰によって extracted 関数を繰り返し呼び出す関数を合成する
+         * @param Extracted 繰り返し対象の extracted 関数
+         * @param ABI キャプチャされた変数の受け渡し方
+         * @return 合成された関数
+         * @details 合成される関数は extracted 関数への引数と再帰回数を受け取る
+         * @note 再帰回数が max_recursion に達した場合は while ループに移行する
+         */
+        llvm::Function *createRecursiveLooper(llvm::Function &Extracted, CaptureABI ABI)
+        {
+            auto &Context = Extracted.getContext();
+            auto *Recursive = llvm::Function::Create(
+                llvm::FunctionType::get(
+                    llvm::Type::getVoidTy(Context),
+                    llvm::ArrayRef<llvm::Type *>{llvm::Type::getInt8PtrTy(Context), llvm::Type::getInt32Ty(Context)},
+                    false /* NOT variadic */),
+                llvm::GlobalValue::LinkageTypes::InternalLinkage,
+                Extracted.getName() + ".looper.rec",
+                Extracted.getParent());
+            Recursive->addFnAttr(LooperAttribute);
+            auto *Args = Recursive->getArg(0), *RecursionCount = Recursive->getArg(1);
+
+            auto *Entry = llvm::BasicBlock::Create(Context, "", Recursive);
+            auto *Recurse = llvm::BasicBlock::Create(Context, "", Recursive);
+            auto *Again = llvm::BasicBlock::Create(Context, "", Recursive);
+            auto *Fallback = llvm::BasicBlock::Create(Context, "", Recursive);
+            auto *Return = llvm::BasicBlock::Create(Context, "", Recursive);
+
+            llvm::IRBuilder Builder(Entry);
+            Builder.CreateCondBr(
+                Builder.CreateICmpULT(RecursionCount, Builder.getInt32(max_recursion)),
+                Recurse,
+                Fallback);
+
+            // extracted 関数が true を返した場合に限り、再帰回数を増やして自身を呼び出す
+            Builder.SetInsertPoint(Recurse);
+            Builder.CreateCondBr(emitInvoke(Builder, Extracted, Args, ABI), Again, Return);
+            Builder.SetInsertPoint(Again);
+            Builder.CreateCall(Recursive, {Args, Builder.CreateAdd(RecursionCount, Builder.getInt32(1))});
+            Builder.CreateBr(Return);
+
+            // 再帰回数が上限に達した場合は while ループに移行する
+            Builder.SetInsertPoint(Fallback);
+            emitWhileLoop(Builder, Extracted, Args, ABI);
+            Builder.CreateBr(Return);
+
+            Builder.SetInsertPoint(Return);
+            Builder.CreateRetVoid();
+            return Recursive;
+        }
+
+        /**
+         * @brief 末尾呼び出しが保証された再帰によって extracted 関数を繰り返し呼び出す関数を合成する
+         * @param Extracted 繰り返し対象の extracted 関数
+         * @param ABI キャプチャされた変数の受け渡し方
+         * @return 合成された関数
+         * @details 自身の呼び出しに musttail を付けるため、再帰の深さによらずスタックの使用量は一定になる
+         * @note 再帰回数に上限がないため、while ループへの移行も発生しない
+         */
+        llvm::Function *createTailRecursiveLooper(llvm::Function &Extracted, CaptureABI ABI)
+        {
+            auto &Context = Extracted.getContext();
+            auto *TailRecursive = llvm::Function::Create(
                 llvm::FunctionType::get(
                     llvm::Type::getVoidTy(Context),
-                    llvm::ArrayRef<llvm::Type *>{getExtractedFunctionType(Context)->getPointerTo()},
-                    true /* variadic */));
+                    llvm::ArrayRef<llvm::Type *>{llvm::Type::getInt8PtrTy(Context)},
+                    false /* NOT variadic */),
+                llvm::GlobalValue::LinkageTypes::InternalLinkage,
+                Extracted.getName() + ".looper.tailrec",
+                Extracted.getParent());
+            TailRecursive->addFnAttr(LooperAttribute);
+            auto *Args = TailRecursive->getArg(0);
+
+            auto *Entry = llvm::BasicBlock::Create(Context, "", TailRecursive);
+            auto *Again = llvm::BasicBlock::Create(Context, "", TailRecursive);
+            auto *Return = llvm::BasicBlock::Create(Context, "", TailRecursive);
+
+            llvm::IRBuilder Builder(Entry);
+            Builder.CreateCondBr(emitInvoke(Builder, Extracted, Args, ABI), Again, Return);
+
+            // extracted 関数が true を返した場合は、自身を末尾呼び出しする
+            Builder.SetInsertPoint(Again);
+            Builder.CreateCall(TailRecursive, {Args})->setTailCallKind(llvm::CallInst::TCK_MustTail);
+            Builder.CreateRetVoid();
+
+            Builder.SetInsertPoint(Return);
+            Builder.CreateRetVoid();
+            return TailRecursive;
+        }
+
+        /**
+         * @brief extracted 関数が false を返すまで繰り返し呼び出すループを挿入する
+         * @param Builder 挿入位置を指す IRBuilder（挿入後はループの脱出先ブロックを指す）
+         * @param Extracted 繰り返し対象の extracted 関数
+         * @param Args extracted 関数に渡す va_list もしくはキャプチャ構造体へのポインタ
+         * @param ABI キャプチャされた変数の受け渡し方
+         */
+        void emitWhileLoop(llvm::IRBuilder<> &Builder, llvm::Function &Extracted, llvm::Value *Args, CaptureABI ABI)
+        {
+            auto *Function = Builder.GetInsertBlock()->getParent();
+            auto *Loop = llvm::BasicBlock::Create(Builder.getContext(), "", Function);
+            auto *Exit = llvm::BasicBlock::Create(Builder.getContext(), "", Function);
+
+            Builder.CreateBr(Loop);
+            Builder.SetInsertPoint(Loop);
+            Builder.CreateCondBr(emitInvoke(Builder, Extracted, Args, ABI), Loop, Exit);
+            Builder.SetInsertPoint(Exit);
+        }
+
+        /**
+         * @brief extracted 関数を一度だけ呼び出す命令を挿入する
+         * @param Builder 挿入位置を指す IRBuilder
+         * @param Extracted 呼び出す extracted 関数
+         * @param Args extracted 関数に渡す va_list もしくはキャプチャ構造体へのポインタ
+         * @param ABI キャプチャされた変数の受け渡し方
+         * @return extracted 関数の返り値
+         * @note va_list はコピーしてから渡すため、何度呼び出しても同じ引数が取り出される
+         */
+        llvm::Value *emitInvoke(llvm::IRBuilder<> &Builder, llvm::Function &Extracted, llvm::Value *Args, CaptureABI ABI)
+        {
+            if (ABI == CaptureABI::Struct) {
+                return Builder.CreateCall(&Extracted, {Args});
+            }
+
+            // コピー先の領域は entry ブロックで確保し、繰り返しごとにスタックが伸びないようにする
+            auto &Entry = Builder.GetInsertBlock()->getParent()->getEntryBlock();
+            auto *Stored = llvm::IRBuilder(&Entry, Entry.getFirstInsertionPt()).CreateAlloca(getVaListType(Builder.getContext()));
+            Builder.CreateIntrinsic(llvm::Intrinsic::vacopy, {}, {Stored, Args});
+            auto *Result = Builder.CreateCall(&Extracted, {Stored});
+            Builder.CreateIntrinsic(llvm::Intrinsic::vaend, {}, {Stored});
+            return Result;
         }
 
         /**
          * @brief extracted 関数の型を作成する
-         * @details extracted 関数は va_list を受け取り、boolean を返却する
+         * @details extracted 関数は va_list もしくはキャプチャ構造体へのポインタを受け取り、boolean を返却する
+         * @param ABI キャプチャされた変数の受け渡し方
          * @return extracted 関数の型
          */
-        llvm::FunctionType *getExtractedFunctionType(llvm::LLVMContext &Context)
+        llvm::FunctionType *getExtractedFunctionType(llvm::LLVMContext &Context, CaptureABI ABI)
+        {
+            auto *ParamType = ABI == CaptureABI::VaList
+                                  ? getVaListType(Context)->getPointerTo()
+                                  : llvm::Type::getInt8PtrTy(Context);
+            return llvm::FunctionType::get(
+                llvm::Type::getInt1Ty(Context),
+                llvm::ArrayRef<llvm::Type *>{ParamType},
+                false /* NOT variadic */);
+        }
+
+        /**
+         * @brief 並列実行用の extracted 関数の型を作成する
+         * @details 並列実行用の extracted 関数はキャプチャ構造体へのポインタと繰り返しの番号を受け取り、boolean を返却する
+         * @note 返り値は通常の extracted 関数と揃えているだけで、looper_parallel 関数では用いない
+         * @return 並列実行用の extracted 関数の型
+         */
+        llvm::FunctionType *getParallelBodyType(llvm::LLVMContext &Context)
         {
             return llvm::FunctionType::get(
                 llvm::Type::getInt1Ty(Context),
-                llvm::ArrayRef<llvm::Type *>{getVaListType(Context)->getPointerTo()},
+                llvm::ArrayRef<llvm::Type *>{llvm::Type::getInt8PtrTy(Context), llvm::Type::getInt64Ty(Context)},
                 false /* NOT variadic */);
         }
 
+        /**
+         * @brief キャプチャ構造体の型を作成する
+         * @param Captures キャプチャされた変数の一覧
+         * @return Captures の各要素の型をこの順に並べたリテラル構造体型
+         * @note リテラル構造体型は一意化されるため、呼び出し側と extracted 関数側で同じ型が得られる
+         */
+        llvm::StructType *getCaptureStructType(llvm::LLVMContext &Context, llvm::ArrayRef<llvm::Value *> Captures)
+        {
+            std::vector<llvm::Type *> Types;
+            for (auto *Capture : Captures) {
+                Types.push_back(Capture->getType());
+            }
+            return llvm::StructType::get(Context, Types);
+        }
+
         /**
          * @brief va_list 型を作成する
          * @return va_list 型
@@ -315,6 +1990,154 @@ namespace {
             return llvm::StructType::create(Name, i32, i32, i8p, i8p);
         }
     };
+
+    /**
+     * @brief 構造が同一の extracted 関数を一つにまとめるパス
+     * @details テンプレートのインスタンス化やインライン展開によって同じ本体を持つループが複数あると、
+     * @details ループごとに同一の extracted 関数が作られてコードサイズと命令キャッシュを圧迫するため、それらを一つにまとめる
+     * @details 同一性の判定には MergeFunctions パスと同じ FunctionComparator を用いるため、
+     * @details キャプチャされた変数の型が異なっていても、アドレス空間 0 のポインタと同じ大きさの整数のように機械語で区別されない型であれば同一とみなす
+     * @note extracted 関数はすべて同じ型を持つため、まとめられた関数の使用箇所（looper 関数の呼び出しの引数など）は残す関数で置き換えるだけでよい
+     * @details 合成された looper 関数も、呼び出す extracted 関数がまとめられると同一になるので同様にまとめる
+     * @details ループの識別子が登録された関数（looper.bc の looper 関数に渡されるもの）は、計測結果がループごとに分かれるよう、
+     * @details 取り除かずに残す関数を末尾呼び出しするだけの関数（thunk）に置き換える
+     * @note looper 関数の呼び出しは呼び出し元ごとにそのまま残る
+     */
+    class MergeExtracted : public llvm::PassInfoMixin<MergeExtracted> {
+    public:
+        llvm::PreservedAnalyses run(llvm::Module &Module, llvm::ModuleAnalysisManager &)
+        {
+            // 外側のループの extracted 関数は内側のループの extracted 関数（合成された looper 関数の場合はそれを呼び出す looper 関数）を
+            // 参照するため、内側がまとめられたことで新たに同一になる関数がなくなるまで繰り返す
+            bool Changed = false;
+            while (mergeOnce(Module)) {
+                Changed = true;
+            }
+            return Changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
+        }
+
+    private:
+        /**
+         * @brief 同一の extracted 関数と合成された looper 関数を一度だけ探してまとめる
+         * @param Module 対象のモジュール
+         * @return まとめられた関数があったか
+         */
+        bool mergeOnce(llvm::Module &Module)
+        {
+            // ハッシュが等しい関数の中から、先に現れたものと同一のものを探す
+            llvm::GlobalNumberState GlobalNumbers;
+            llvm::MapVector<llvm::FunctionComparator::FunctionHash, llvm::SmallVector<llvm::Function *, 4>> Buckets;
+            llvm::MapVector<llvm::Function *, llvm::SmallVector<llvm::Function *, 4>> Duplicates;
+            for (auto &&Function : Module) {
+                if (Function.isDeclaration()
+                    || !(Function.hasFnAttribute(ExtractedAttribute) || Function.hasFnAttribute(LooperAttribute))) {
+                    continue;
+                }
+                auto &Bucket = Buckets[llvm::FunctionComparator::functionHash(Function)];
+                auto Original = llvm::find_if(Bucket, [&](auto *Other) {
+                    return llvm::FunctionComparator(Other, &Function, &GlobalNumbers).compare() == 0;
+                });
+                if (Original != Bucket.end()) {
+                    Duplicates[*Original].push_back(&Function);
+                } else {
+                    Bucket.push_back(&Function);
+                }
+            }
+
+            for (auto &&[Original, Functions] : Duplicates) {
+                unsigned Saved = 0;
+                for (auto *Function : Functions) {
+                    Saved += Function->getInstructionCount();
+                    if (hasLoopId(*Function)) {
+                        Saved -= createThunk(*Function, *Original)->getInstructionCount();
+                    } else {
+                        Function->replaceAllUsesWith(Original);
+                    }
+                    Function->eraseFromParent();
+                }
+                llvm::OptimizationRemarkEmitter ORE(Original);
+                ORE.emit([&] {
+                    return llvm::OptimizationRemark(DEBUG_TYPE, "MergedExtracted", Original)
+                        << "merged " << llvm::ore::NV("Merged", static_cast<unsigned>(Functions.size()))
+                        << " identical " << (Original->hasFnAttribute(LooperAttribute) ? "looper" : "extracted")
+                        << " functions into " << llvm::ore::NV("Function", Original)
+                        << ", saving " << llvm::ore::NV("InstructionsSaved", Saved) << " instructions";
+                });
+            }
+            return !Duplicates.empty();
+        }
+
+        /**
+         * @brief 関数にループの識別子が登録されているか判定する
+         * @param Function 判定対象の関数
+         * @return LoopIdSection に置かれた識別子の組から参照されているか
+         */
+        bool hasLoopId(llvm::Function &Function)
+        {
+            return llvm::any_of(Function.users(), [](llvm::User *User) {
+                return llvm::isa<llvm::ConstantStruct>(User) && llvm::any_of(User->users(), [](llvm::User *Entry) {
+                    auto *Variable = llvm::dyn_cast<llvm::GlobalVariable>(Entry);
+                    return Variable && Variable->getSection() == LoopIdSection;
+                });
+            });
+        }
+
+        /**
+         * @brief 関数を、同一の関数を末尾呼び出しするだけの関数で置き換える
+         * @param Function 置き換えられる関数（呼び出し元で取り除く）
+         * @param Original 呼び出し先となる同一の関数
+         * @return 作成した関数
+         * @details 作成した関数は元の関数の名前と使用箇所（ループの識別子を含む）を引き継ぐため、looper 関数からは別の関数として見える
+         * @note 作成した関数はこれ以上まとめないよう、extracted 関数を表す関数属性を持たない
+         */
+        llvm::Function *createThunk(llvm::Function &Function, llvm::Function &Original)
+        {
+            auto *Thunk = llvm::Function::Create(
+                Function.getFunctionType(), Function.getLinkage(), "", Function.getParent());
+            Thunk->copyAttributesFrom(&Function);
+            Thunk->removeFnAttr(ExtractedAttribute);
+            Thunk->removeFnAttr(BatchAttribute);
+            Thunk->takeName(&Function);
+            Thunk->getParent()->getFunctionList().remove(Thunk);
+            Function.getParent()->getFunctionList().insertAfter(Function.getIterator(), Thunk);
+
+            llvm::IRBuilder Builder(llvm::BasicBlock::Create(Function.getContext(), "", Thunk));
+            llvm::SmallVector<llvm::Value *, 2> Args;
+            for (auto &&Arg : Thunk->args()) {
+                Args.push_back(&Arg);
+            }
+            auto *Call = Builder.CreateCall(&Original, Args);
+            Call->setTailCallKind(llvm::CallInst::TCK_Tail);
+            Builder.CreateRet(Call);
+
+            Function.replaceAllUsesWith(Thunk);
+            return Thunk;
+        }
+    };
+
+    /**
+     * @brief LambdaizeLoop パスとその前処理をパスマネージャに追加する
+     * @param MPM 追加先の ModulePassManager
+     * @note vectorize が指定されている場合は、先にループベクトル化を行う
+     * @note merge が指定されている場合は、続けて MergeExtracted パスも追加する
+     */
+    void addLambdaizeLoopPasses(llvm::ModulePassManager &MPM)
+    {
+        llvm::FunctionPassManager FPM;
+        if (vectorize != VectorPart::None) {
+            // すでにベクトル化されたループ（llvm.loop.isvectorized を持つもの）はそのまま残される
+            FPM.addPass(llvm::LoopSimplifyPass());
+            FPM.addPass(llvm::LCSSAPass());
+            FPM.addPass(llvm::LoopVectorizePass());
+        }
+        FPM.addPass(llvm::LoopSimplifyPass());
+        FPM.addPass(llvm::LCSSAPass());
+        MPM.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(FPM)));
+        MPM.addPass(LambdaizeLoop());
+        if (merge) {
+            MPM.addPass(MergeExtracted());
+        }
+    }
 }
 
 extern "C" LLVM_ATTRIBUTE_WEAK llvm::PassPluginLibraryInfo llvmGetPassPluginInfo()
@@ -325,13 +2148,22 @@ extern "C" LLVM_ATTRIBUTE_WEAK llvm::PassPluginLibraryInfo llvmGetPassPluginInfo
         "1.0.0",
         [](llvm::PassBuilder &PB) {
             PB.registerPipelineParsingCallback(
-                [](llvm::StringRef Name, llvm::FunctionPassManager &FPM, llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
+                [](llvm::StringRef Name, llvm::ModulePassManager &MPM, llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
                     if (Name == "lambdaize-loop") {
-                        FPM.addPass(llvm::LoopSimplifyPass());
-                        FPM.addPass(LambdaizeLoop());
+                        addLambdaizeLoopPasses(MPM);
+                        return true;
+                    }
+                    if (Name == "lambdaize-merge") {
+                        MPM.addPass(MergeExtracted());
                         return true;
                     }
                     return false;
                 });
+
+            // clang -fpass-plugin で読み込まれた場合は、最適化パイプラインの最後で難読化する
+            PB.registerOptimizerLastEPCallback(
+                [](llvm::ModulePassManager &MPM, llvm::OptimizationLevel) {
+                    addLambdaizeLoopPasses(MPM);
+                });
         }};
 }
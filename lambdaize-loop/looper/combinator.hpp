@@ -3,6 +3,7 @@
  * @brief 高階関数型と各種コンビネータの実装
  */
 
+#include <cstddef>
 #include <functional>
 #include <utility>
 
@@ -71,3 +72,79 @@ public:
         return foo(foo);
     };
 };
+
+/**
+ * @brief 型消去を行わずに全ての引数を個別に扱う不動点コンビネータ
+ * @tparam N カリー化された引数の個数
+ * @details 再帰の型を std::function で表す代わりにテンプレートの型推論に任せるため、
+ * @details 再帰のたびにクロージャが動的確保されたり間接呼び出しが発生したりすることがない
+ * @details 自己適用 x(x) は引数が N 個揃うまで遅延させ、戻り値型の推論が循環しないようにしている
+ * @note f が返す関数は引数を auto で受け取り、最も内側の関数は戻り値型を明示しておく必要がある
+ */
+template <std::size_t N>
+class deduced_fixed_point_combinator_one_argument {
+private:
+    /**
+     * @brief 関数に引数を一つずつ順に適用する
+     */
+    template <class G, class T, class... Types>
+    static decltype(auto) apply(G &&g, T &&arg, Types &&...args)
+    {
+        if constexpr (sizeof...(Types) == 0) {
+            return std::forward<G>(g)(std::forward<T>(arg));
+        } else {
+            return apply(std::forward<G>(g)(std::forward<T>(arg)), std::forward<Types>(args)...);
+        }
+    }
+
+    /**
+     * @brief 引数が N 個揃うまで x(x) の適用を遅延させる関数を作成する
+     */
+    template <class X, class... Types>
+    static auto defer(X x, Types... args)
+    {
+        return [x, args...](auto &&y) -> decltype(auto) {
+            if constexpr (sizeof...(Types) + 1 == N) {
+                return apply(x(x), args..., std::forward<decltype(y)>(y));
+            } else {
+                return defer(x, args..., std::forward<decltype(y)>(y));
+            }
+        };
+    }
+
+public:
+    deduced_fixed_point_combinator_one_argument() = delete;
+
+    /**
+     * @brief Z コンビネータの実装
+     */
+    static inline const auto Z = [](auto f) {
+        auto foo = [f](auto x) {
+            return f(defer(x));
+        };
+        return foo(foo);
+    };
+};
+
+/**
+ * @brief 型消去を行わずに全ての引数をひとまとまりとして扱う不動点コンビネータ
+ * @see deduced_fixed_point_combinator_one_argument
+ * @note f が返す関数は引数を auto で受け取り、なおかつ戻り値型を明示しておく必要がある
+ */
+class deduced_fixed_point_combinator_multiple_arguments {
+public:
+    deduced_fixed_point_combinator_multiple_arguments() = delete;
+
+    /**
+     * @brief Z コンビネータの実装
+     */
+    static inline const auto Z = [](auto f) {
+        auto foo = [f](auto x) {
+            auto bar = [x](auto &&...y) -> decltype(auto) {
+                return x(x)(std::forward<decltype(y)>(y)...);
+            };
+            return f(bar);
+        };
+        return foo(foo);
+    };
+};
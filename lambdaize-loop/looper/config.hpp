@@ -0,0 +1,263 @@
+/**
+ * @file config.hpp
+ * @brief looper 関数の実行時の設定
+ * @details 繰り返しの方法と再帰の上限を、環境変数 LOOPER_STRATEGY と LOOPER_MAX_RECURSION、
+ * @details もしくは looper_configure 関数によって再ビルドなしに切り替えられるようにする
+ * @details 再帰の上限には、スレッドのスタックの残りから求める adaptive も指定できる
+ */
+
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+
+#ifndef MAX_RECURSION_COUNT
+#define MAX_RECURSION_COUNT 8192
+#endif
+
+namespace config {
+    /**
+     * @brief 繰り返しの方法
+     */
+    enum class strategy : int {
+        simple_while,               ///< 再帰せずに while ループで繰り返す
+        one_argument,               ///< 全ての変数を個別に扱う Z コンビネータ（std::function を用いる）
+        multiple_arguments,         ///< 全ての変数をひとまとまりで扱う Z コンビネータ（std::function を用いる）
+        one_argument_deduced,       ///< 全ての変数を個別に扱う、型消去を行わない Z コンビネータ
+        multiple_arguments_deduced, ///< 全ての変数をひとまとまりで扱う、型消去を行わない Z コンビネータ
+        trampoline,                 ///< トランポリンを用いる Z コンビネータ
+    };
+
+    /**
+     * @brief strategy の要素数
+     */
+    constexpr std::size_t strategy_count = 6;
+
+    /**
+     * @brief 環境変数と looper_configure 関数で用いる strategy の名前
+     * @note std::function を用いる strategy は LOOPER_TYPE_ERASED を定義してビルドした場合のみ選べる
+     */
+    constexpr struct {
+        const char *name;
+        strategy value;
+    } strategy_names[] = {
+        {"while", strategy::simple_while},
+#ifdef LOOPER_TYPE_ERASED
+        {"one", strategy::one_argument},
+        {"multiple", strategy::multiple_arguments},
+#endif
+        {"one-deduced", strategy::one_argument_deduced},
+        {"multiple-deduced", strategy::multiple_arguments_deduced},
+        {"trampoline", strategy::trampoline},
+    };
+
+    /**
+     * @brief 再帰の上限をスタックの残りから求めることを表す値
+     */
+    constexpr unsigned adaptive = 0;
+
+    /**
+     * @brief スタックの残りのうち、looper 関数の再帰に使わずに残しておく大きさ
+     * @note loopee 自身やその中から呼び出される関数、シグナルハンドラが使う分である
+     */
+    constexpr std::size_t stack_reserve = 16 * 1024;
+
+    /**
+     * @brief 再帰一段あたりのスタックの使用量が計測されるまで用いる見積もり
+     */
+    constexpr std::size_t default_frame_size = 1024;
+
+    inline std::atomic<int> current_strategy{static_cast<int>(strategy::trampoline)}; ///< 現在の繰り返しの方法
+    inline std::atomic<unsigned> max_recursion{MAX_RECURSION_COUNT};                 ///< 再帰の上限（adaptive を含む）
+    inline pthread_once_t environment_loaded = PTHREAD_ONCE_INIT;
+
+    /**
+     * @brief strategy ごとに計測された、再帰一段あたりのスタックの使用量（未計測の場合は 0）
+     */
+    inline std::atomic<std::size_t> frame_sizes[strategy_count];
+
+    /**
+     * @brief このスレッドで実行中の looper 関数が用いる再帰の上限
+     */
+    inline thread_local unsigned recursion_limit = MAX_RECURSION_COUNT;
+
+    /**
+     * @brief 再帰一段あたりのスタックの使用量を計測するための状態
+     * @details 計測中は invoke が呼び出されるたびにスタックの位置を記録し、連続する二回の差を使用量とする
+     */
+    struct calibration {
+        int target = -1;          ///< 計測中の strategy（計測中でない場合は -1）
+        char *previous = nullptr; ///< 直前の invoke の呼び出しで記録したスタックの位置
+    };
+    inline thread_local calibration probe;
+
+    /**
+     * @brief このスレッドのスタックの下端（未取得の場合は nullptr）
+     */
+    inline thread_local char *stack_low = nullptr;
+
+    /**
+     * @brief 名前から strategy を求める
+     * @param name strategy の名前
+     * @param[out] result 求めた strategy
+     * @return 名前が正しいか
+     */
+    inline bool parse_strategy(const char *name, strategy &result)
+    {
+        for (auto &&entry : strategy_names) {
+            if (std::strcmp(entry.name, name) == 0) {
+                result = entry.value;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief 文字列から再帰の上限を求める
+     * @param text 正の整数もしくは "auto"
+     * @param[out] result 求めた上限（"auto" の場合は adaptive）
+     * @return 文字列が正しいか
+     */
+    inline bool parse_max_recursion(const char *text, unsigned &result)
+    {
+        if (std::strcmp(text, "auto") == 0) {
+            result = adaptive;
+            return true;
+        }
+        char *end;
+        auto value = std::strtoul(text, &end, 10);
+        if (*text == '\0' || *end != '\0' || value == 0 || value > UINT_MAX) {
+            return false;
+        }
+        result = static_cast<unsigned>(value);
+        return true;
+    }
+
+    /**
+     * @brief 環境変数 LOOPER_STRATEGY と LOOPER_MAX_RECURSION から設定を読み込む
+     * @note 正しくない値は標準エラー出力に報告したうえで無視し、デフォルトの設定を用いる
+     */
+    inline void load_environment()
+    {
+        strategy value;
+        if (auto *name = std::getenv("LOOPER_STRATEGY"); name && parse_strategy(name, value)) {
+            current_strategy.store(static_cast<int>(value), std::memory_order_relaxed);
+        } else if (name) {
+            // std::function を用いる strategy は名前が正しくてもビルドの設定によっては選べない
+            bool type_erased = std::strcmp(name, "one") == 0 || std::strcmp(name, "multiple") == 0;
+            std::fprintf(stderr, "looper: ignoring LOOPER_STRATEGY=%s (%s), using trampoline\n", name,
+                         type_erased ? "build looper with TYPE_ERASED=yes to use it" : "unknown strategy");
+        }
+        unsigned limit;
+        if (auto *text = std::getenv("LOOPER_MAX_RECURSION"); text && parse_max_recursion(text, limit)) {
+            max_recursion.store(limit, std::memory_order_relaxed);
+        } else if (text) {
+            std::fprintf(stderr, "looper: ignoring LOOPER_MAX_RECURSION=%s (expected a positive integer or auto)\n", text);
+        }
+    }
+
+    /**
+     * @brief 環境変数を読み込んでいなければ読み込む
+     */
+    inline void ensure_loaded()
+    {
+        pthread_once(&environment_loaded, load_environment);
+    }
+
+    /**
+     * @brief 現在の繰り返しの方法を得る
+     */
+    inline strategy get_strategy()
+    {
+        ensure_loaded();
+        return static_cast<strategy>(current_strategy.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief このスレッドのスタックの下端を得る
+     * @return スタックの下端（取得できない場合は nullptr）
+     */
+    inline char *get_stack_low()
+    {
+#ifdef __GLIBC__
+        if (!stack_low) {
+            pthread_attr_t attr;
+            if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+                void *addr;
+                std::size_t size;
+                if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                    stack_low = static_cast<char *>(addr);
+                }
+                pthread_attr_destroy(&attr);
+            }
+        }
+#endif
+        return stack_low;
+    }
+
+    /**
+     * @brief looper 関数の呼び出しで用いる再帰の上限を求める
+     * @param target 用いる繰り返しの方法
+     * @return 再帰の上限
+     * @details adaptive の場合は、スタックの残りから stack_reserve を引いた大きさを再帰一段あたりの使用量で割ったものを上限とする
+     * @details 使用量が未計測の strategy は default_frame_size で見積もり、この呼び出しの中で計測する
+     * @note スタックの範囲が取得できない場合は MAX_RECURSION_COUNT を用いる
+     */
+    inline unsigned get_recursion_limit(strategy target)
+    {
+        auto limit = max_recursion.load(std::memory_order_relaxed);
+        if (limit != adaptive) {
+            return limit;
+        }
+        auto *low = get_stack_low();
+        if (!low) {
+            return MAX_RECURSION_COUNT;
+        }
+        auto remaining = static_cast<std::size_t>(static_cast<char *>(__builtin_frame_address(0)) - low);
+        if (remaining <= stack_reserve) {
+            return 0;
+        }
+
+        auto index = static_cast<int>(target);
+        auto frame_size = frame_sizes[index].load(std::memory_order_relaxed);
+        if (!frame_size) {
+            frame_size = default_frame_size;
+            probe = {index, nullptr};
+        }
+        auto depth = (remaining - stack_reserve) / frame_size;
+        return depth > UINT_MAX ? UINT_MAX : static_cast<unsigned>(depth);
+    }
+
+    /**
+     * @brief 計測中であれば、再帰一段あたりのスタックの使用量を記録する
+     * @param frame 呼び出し元のスタックの位置
+     * @details 計測できた場合は、実行中の呼び出しの再帰の上限も計測した使用量に基づいて求めなおす
+     * @note スタックは下位アドレスに向かって伸びるものとする
+     */
+    inline void observe_frame(char *frame)
+    {
+        if (probe.target < 0) {
+            return;
+        }
+        if (!probe.previous) {
+            probe.previous = frame;
+            return;
+        }
+        if (frame < probe.previous) {
+            auto frame_size = static_cast<std::size_t>(probe.previous - frame);
+            frame_sizes[probe.target].store(frame_size, std::memory_order_relaxed);
+
+            // この時点で再帰は一段進んでいる
+            auto remaining = static_cast<std::size_t>(frame - stack_low);
+            auto depth = remaining > stack_reserve ? (remaining - stack_reserve) / frame_size + 1 : 1;
+            if (depth < recursion_limit) {
+                recursion_limit = static_cast<unsigned>(depth);
+            }
+        }
+        probe = {};
+    }
+}
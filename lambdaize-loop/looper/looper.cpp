@@ -4,83 +4,253 @@
  */
 
 #include "combinator.hpp"
+#include "config.hpp"
+#include "parallel.hpp"
+#include "telemetry.hpp"
 #include <cstdarg>
+#include <cstdint>
+#include <optional>
 
-#ifndef MAX_RECURSION_COUNT
-#define MAX_RECURSION_COUNT 8192
+/**
+ * @def LOOPER_PLACEMENT
+ * @brief 繰り返しの度に実行される関数に付ける、配置を指定する属性
+ * @details LOOPER_SECTION を定義してビルドするとそのセクションに、LOOPER_ALIGN を定義してビルドするとその境界に揃えて配置する
+ * @details パスの -lambdaize-section と同じセクションを指定すると、extracted 関数と looper 関数がリンク時に隣接して配置される
+ */
+#ifdef LOOPER_SECTION
+#define LOOPER_SECTION_ATTRIBUTE __attribute__((section(LOOPER_SECTION)))
+#else
+#define LOOPER_SECTION_ATTRIBUTE
+#endif
+#ifdef LOOPER_ALIGN
+#define LOOPER_ALIGN_ATTRIBUTE __attribute__((aligned(LOOPER_ALIGN)))
+#else
+#define LOOPER_ALIGN_ATTRIBUTE
 #endif
+#define LOOPER_PLACEMENT LOOPER_SECTION_ATTRIBUTE LOOPER_ALIGN_ATTRIBUTE
 
 namespace {
     /**
-     * @brief 再帰せずに繰り返し処理を行う
+     * @brief loopee を一度だけ呼び出す
      * @param loopee 繰り返し対象の関数へのポインタ
      * @param vl loopee への引数
+     * @return loopee の返り値
+     * @note vl はコピーしてから渡すため、何度呼び出しても同じ引数が取り出される
      */
-    void simple_while(bool (*loopee)(va_list), va_list vl)
+    LOOPER_PLACEMENT bool invoke(bool (*loopee)(va_list), va_list vl)
     {
-        while (true) {
-            va_list stored;
-            va_copy(stored, vl);
-            bool result = loopee(stored);
-            va_end(stored);
-            if (!result) break;
-        }
+        telemetry::count_iteration();
+        telemetry::observe_stack(static_cast<char *>(__builtin_frame_address(0)));
+        config::observe_frame(static_cast<char *>(__builtin_frame_address(0)));
+        va_list stored;
+        va_copy(stored, vl);
+        bool result = loopee(stored);
+        va_end(stored);
+        return result;
+    }
+
+    /**
+     * @brief loopee を一度だけ呼び出す
+     * @param loopee 繰り返し対象の関数へのポインタ
+     * @param captures loopee への引数をまとめた構造体へのポインタ
+     * @return loopee の返り値
+     * @note 構造体は loopee から読み出されるだけなのでコピーは行わない
+     */
+    LOOPER_PLACEMENT bool invoke(bool (*loopee)(void *), void *captures)
+    {
+        telemetry::count_iteration();
+        telemetry::observe_stack(static_cast<char *>(__builtin_frame_address(0)));
+        config::observe_frame(static_cast<char *>(__builtin_frame_address(0)));
+        return loopee(captures);
+    }
+
+    /**
+     * @brief 再帰せずに繰り返し処理を行う
+     * @param loopee 繰り返し対象の関数へのポインタ
+     * @param context loopee への引数
+     */
+    template <class Context>
+    LOOPER_PLACEMENT void simple_while(bool (*loopee)(Context), Context context)
+    {
+        while (invoke(loopee, context));
     }
 
     /**
      * @brief 全ての変数を個別に扱う Z コンビネータで再帰を行う
      * @param loopee 繰り返し対象の関数へのポインタ
-     * @param vl loopee への引数
-     * @note 再帰回数が MAX_RECURSION_COUNT に達した場合は simple_while に移行する
+     * @param context loopee への引数
+     * @note 再帰回数が config::recursion_limit に達した場合は simple_while に移行する
      */
-    void z_combinator_one_argument(bool (*loopee)(va_list), va_list vl)
+    template <class Context>
+    LOOPER_PLACEMENT void z_combinator_one_argument(bool (*loopee)(Context), Context context)
     {
-        using F = higher_order_function<void, unsigned, decltype(vl), decltype(loopee)>;
+        using F = higher_order_function<void, unsigned, decltype(context), decltype(loopee)>;
         auto internal = [](auto f) {
-            return [f](bool (*loopee)(va_list)) {
-                return [f, loopee](va_list vl) {
-                    return [f, loopee, vl](unsigned recursion_count) {
-                        if (recursion_count < MAX_RECURSION_COUNT) {
-                            va_list stored;
-                            va_copy(stored, vl);
-                            if (loopee(vl)) {
-                                f(loopee)(stored)(recursion_count + 1);
+            return [f](bool (*loopee)(Context)) {
+                return [f, loopee](Context context) {
+                    return [f, loopee, context](unsigned recursion_count) {
+                        if (recursion_count < config::recursion_limit) {
+                            if (invoke(loopee, context)) {
+                                f(loopee)(context)(recursion_count + 1);
                             }
-                            va_end(stored);
                         } else {
-                            simple_while(loopee, vl);
+                            telemetry::count_fallback();
+                            simple_while(loopee, context);
                         }
                     };
                 };
             };
         };
-        fixed_point_combinator_one_argument<F>::Z(internal)(loopee)(vl)(0);
+        fixed_point_combinator_one_argument<F>::Z(internal)(loopee)(context)(0);
     }
 
     /**
      * @brief 全ての変数をひとまとまりで扱う Z コンビネータで再帰を行う
      * @param loopee 繰り返し対象の関数へのポインタ
-     * @param vl loopee への引数
-     * @note 再帰回数が MAX_RECURSION_COUNT に達した場合は simple_while に移行する
+     * @param context loopee への引数
+     * @note 再帰回数が config::recursion_limit に達した場合は simple_while に移行する
      */
-    void z_combinator_multiple_arguments(bool (*loopee)(va_list), va_list vl)
+    template <class Context>
+    LOOPER_PLACEMENT void z_combinator_multiple_arguments(bool (*loopee)(Context), Context context)
     {
-        using F = std::function<void(decltype(loopee), decltype(vl), unsigned)>;
+        using F = std::function<void(decltype(loopee), decltype(context), unsigned)>;
         auto internal = [](auto f) {
-            return [f](bool (*loopee)(va_list), va_list vl, unsigned recursion_count) {
-                if (recursion_count < MAX_RECURSION_COUNT) {
-                    va_list stored;
-                    va_copy(stored, vl);
-                    if (loopee(vl)) {
-                        f(loopee, stored, recursion_count + 1);
+            return [f](bool (*loopee)(Context), Context context, unsigned recursion_count) {
+                if (recursion_count < config::recursion_limit) {
+                    if (invoke(loopee, context)) {
+                        f(loopee, context, recursion_count + 1);
                     }
-                    va_end(stored);
                 } else {
-                    simple_while(loopee, vl);
+                    telemetry::count_fallback();
+                    simple_while(loopee, context);
                 }
             };
         };
-        fixed_point_combinator_multiple_arguments<F>::Z(internal)(loopee, vl, 0);
+        fixed_point_combinator_multiple_arguments<F>::Z(internal)(loopee, context, 0);
+    }
+
+    /**
+     * @brief 全ての変数を個別に扱う Z コンビネータで、型消去を行わずに再帰を行う
+     * @param loopee 繰り返し対象の関数へのポインタ
+     * @param context loopee への引数
+     * @note std::function を経由しないため、繰り返しごとの動的確保や間接呼び出しが発生しない
+     * @note 再帰回数が config::recursion_limit に達した場合は simple_while に移行する
+     */
+    template <class Context>
+    LOOPER_PLACEMENT void z_combinator_one_argument_deduced(bool (*loopee)(Context), Context context)
+    {
+        auto internal = [](auto f) {
+            return [f](auto loopee) {
+                return [f, loopee](auto context) {
+                    return [f, loopee, context](auto recursion_count) -> void {
+                        if (recursion_count < config::recursion_limit) {
+                            if (invoke(loopee, context)) {
+                                f(loopee)(context)(recursion_count + 1);
+                            }
+                        } else {
+                            telemetry::count_fallback();
+                            simple_while(loopee, context);
+                        }
+                    };
+                };
+            };
+        };
+        deduced_fixed_point_combinator_one_argument<3>::Z(internal)(loopee)(context)(0u);
+    }
+
+    /**
+     * @brief 全ての変数をひとまとまりで扱う Z コンビネータで、型消去を行わずに再帰を行う
+     * @param loopee 繰り返し対象の関数へのポインタ
+     * @param context loopee への引数
+     * @note std::function を経由しないため、繰り返しごとの動的確保や間接呼び出しが発生しない
+     * @note 再帰回数が config::recursion_limit に達した場合は simple_while に移行する
+     */
+    template <class Context>
+    LOOPER_PLACEMENT void z_combinator_multiple_arguments_deduced(bool (*loopee)(Context), Context context)
+    {
+        auto internal = [](auto f) {
+            return [f](auto loopee, auto context, auto recursion_count) -> void {
+                if (recursion_count < config::recursion_limit) {
+                    if (invoke(loopee, context)) {
+                        f(loopee, context, recursion_count + 1);
+                    }
+                } else {
+                    telemetry::count_fallback();
+                    simple_while(loopee, context);
+                }
+            };
+        };
+        deduced_fixed_point_combinator_multiple_arguments::Z(internal)(loopee, context, 0u);
+    }
+
+    /**
+     * @brief トランポリンを用いて、スタックを消費せずに Z コンビネータで再帰を行う
+     * @param loopee 繰り返し対象の関数へのポインタ
+     * @param context loopee への引数
+     * @details 再帰する関数は自身を呼び出す代わりに次に呼び出すべき関数を返却し、
+     * @details それをループで呼び出し続けることで再帰の深さによらずスタックの使用量を一定に保つ
+     * @note 再帰回数に上限がないため、simple_while への移行も発生しない
+     */
+    template <class Context>
+    LOOPER_PLACEMENT void z_combinator_trampoline(bool (*loopee)(Context), Context context)
+    {
+        auto internal = [](auto f) {
+            return [f](auto loopee, auto context) -> std::optional<decltype(f)> {
+                if (invoke(loopee, context)) {
+                    return f;
+                }
+                return std::nullopt;
+            };
+        };
+        // クロージャは代入できないため、次に呼び出すべき関数はその都度構築しなおす
+        for (auto next = deduced_fixed_point_combinator_multiple_arguments::Z(internal)(loopee, context); next;) {
+            if (auto following = (*next)(loopee, context)) {
+                next.emplace(*following);
+            } else {
+                next.reset();
+            }
+        }
+    }
+
+    /**
+     * @brief 設定された方法で繰り返し処理を行う
+     * @param loopee 繰り返し対象の関数へのポインタ
+     * @param context loopee への引数
+     * @note 再帰の上限は呼び出しごとに求め、入れ子になった looper 関数から戻った際に元に戻す
+     */
+    template <class Context>
+    LOOPER_PLACEMENT void dispatch(bool (*loopee)(Context), Context context)
+    {
+        auto strategy = config::get_strategy();
+        auto saved = config::recursion_limit;
+        config::recursion_limit = config::get_recursion_limit(strategy);
+        switch (strategy) {
+        case config::strategy::simple_while:
+            simple_while(loopee, context);
+            break;
+#ifdef LOOPER_TYPE_ERASED
+        case config::strategy::one_argument:
+            z_combinator_one_argument(loopee, context);
+            break;
+        case config::strategy::multiple_arguments:
+            z_combinator_multiple_arguments(loopee, context);
+            break;
+#endif
+        case config::strategy::one_argument_deduced:
+            z_combinator_one_argument_deduced(loopee, context);
+            break;
+        case config::strategy::multiple_arguments_deduced:
+            z_combinator_multiple_arguments_deduced(loopee, context);
+            break;
+        case config::strategy::trampoline:
+        default:
+            // 名前の解釈で弾かれるため、ここに TYPE_ERASED なしの std::function の strategy が来ることはない
+            z_combinator_trampoline(loopee, context);
+            break;
+        }
+        // 一回で終わったなどで計測が済んでいない場合は、次の呼び出しで計測しなおす
+        config::probe = {};
+        config::recursion_limit = saved;
     }
 }
 
@@ -89,13 +259,66 @@ namespace {
  * @param loopee 繰り返し対象の関数へのポインタ
  * @param ... loopee への引数
  */
-extern "C" void looper(bool (*loopee)(va_list), ...)
+extern "C" LOOPER_PLACEMENT void looper(bool (*loopee)(va_list), ...)
 {
+    telemetry::scope scope(reinterpret_cast<const void *>(loopee));
     va_list vl;
     va_start(vl, loopee);
-    //simple_while(loopee, vl);
-    //z_combinator_one_argument(loopee, vl);
-    z_combinator_multiple_arguments(loopee, vl);
+    dispatch(loopee, vl);
     va_end(vl);
     return;
 }
+
+/**
+ * @brief 引数を構造体で受け渡す looper 関数
+ * @param loopee 繰り返し対象の関数へのポインタ
+ * @param captures loopee への引数をまとめた構造体へのポインタ
+ * @note va_list を経由しないため、繰り返しごとの va_copy や va_arg が発生しない
+ */
+extern "C" LOOPER_PLACEMENT void looper_struct(bool (*loopee)(void *), void *captures)
+{
+    telemetry::scope scope(reinterpret_cast<const void *>(loopee));
+    dispatch(loopee, captures);
+    return;
+}
+
+/**
+ * @brief 繰り返しを並列に行う looper 関数
+ * @param body 繰り返しの本体へのポインタ
+ * @param captures body への引数をまとめた構造体へのポインタ
+ * @param count 繰り返しの回数
+ * @details body は繰り返しの番号を受け取り、その回の繰り返しだけを行う
+ * @note 各繰り返しが互いに独立であるループ（llvm.loop.parallel_accesses が付いたループ）に対してのみ用いる
+ */
+extern "C" LOOPER_PLACEMENT void looper_parallel(bool (*body)(void *, std::uint64_t), void *captures, std::uint64_t count)
+{
+    telemetry::scope scope(reinterpret_cast<const void *>(body));
+    telemetry::count_iterations(count);
+    parallel::instance.run(body, captures, count);
+}
+
+/**
+ * @brief looper 関数と looper_struct 関数の繰り返しの方法と再帰の上限を設定する
+ * @param strategy 繰り返しの方法の名前（"while"、"one-deduced"、"multiple-deduced"、"trampoline" など）、変更しない場合は nullptr
+ * @param max_recursion 再帰の上限の正の整数もしくは "auto"、変更しない場合は nullptr
+ * @return 指定された値がすべて正しく、設定が変更されたときは 0、そうでない場合は -1
+ * @note 環境変数 LOOPER_STRATEGY と LOOPER_MAX_RECURSION による設定より優先される
+ * @note 実行中の looper 関数には影響しない
+ */
+extern "C" int looper_configure(const char *strategy, const char *max_recursion)
+{
+    config::strategy parsed_strategy;
+    unsigned parsed_max_recursion;
+    if ((strategy && !config::parse_strategy(strategy, parsed_strategy)) ||
+        (max_recursion && !config::parse_max_recursion(max_recursion, parsed_max_recursion))) {
+        return -1;
+    }
+    config::ensure_loaded();
+    if (strategy) {
+        config::current_strategy.store(static_cast<int>(parsed_strategy), std::memory_order_relaxed);
+    }
+    if (max_recursion) {
+        config::max_recursion.store(parsed_max_recursion, std::memory_order_relaxed);
+    }
+    return 0;
+}
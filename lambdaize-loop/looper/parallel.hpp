@@ -0,0 +1,231 @@
+/**
+ * @file parallel.hpp
+ * @brief 繰り返しを複数のスレッドで分担して実行するスレッドプール
+ * @details 繰り返しの範囲をスレッドごとに等分して割り当て、自分の範囲を使い切ったスレッドは
+ * @details 他のスレッドの残りの範囲の後ろ半分を奪って実行する（ワークスティーリング）
+ * @details C のプログラムにもリンクできるよう、C++ の実行時ライブラリではなく pthread を直接用い、動的確保も行わない
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace parallel {
+    /**
+     * @brief 繰り返しの本体の型
+     * @details 第一引数にキャプチャされた変数をまとめた構造体へのポインタ、第二引数に繰り返しの番号を受け取る
+     */
+    using body_type = bool (*)(void *, std::uint64_t);
+
+    /**
+     * @brief 生成するワーカースレッドの最大数
+     */
+    constexpr std::size_t max_workers = 64;
+
+    /**
+     * @brief スレッドプール
+     * @note ワーカースレッドは初めて使われるときに生成され、待機したままプロセスの終了とともに破棄される
+     * @note デストラクタを持たないため定数初期化され、C++ の実行時ライブラリ（例外処理を含む）にも依存しない
+     * @note ワーカースレッドの数は環境変数 LOOPER_THREADS で指定でき、指定しない場合はオンラインの CPU 数から 1 を引いた数になる
+     */
+    class pool {
+    public:
+        /**
+         * @brief body を 0 から count - 1 までの各番号について一度ずつ呼び出す
+         * @param body 繰り返しの本体
+         * @param captures body に渡す構造体へのポインタ
+         * @param count 繰り返しの回数
+         * @note 呼び出し元のスレッドも繰り返しを分担する
+         * @note 別の繰り返しを実行中の場合（body の中から呼び出された場合を含む）は、呼び出し元のスレッドだけで実行する
+         */
+        void run(body_type body, void *captures, std::uint64_t count)
+        {
+            if (pthread_mutex_trylock(&busy) != 0) {
+                run_serially(body, captures, count);
+                return;
+            }
+            if (!started) {
+                spawn();
+            }
+            if (worker_count == 0 || count < 2) {
+                run_serially(body, captures, count);
+                pthread_mutex_unlock(&busy);
+                return;
+            }
+
+            // ワーカースレッドは待機中なので、範囲の割り当てはロックの外で行ってよい
+            auto participants = worker_count + 1;
+            for (std::size_t i = 0; i < participants; ++i) {
+                ranges[i].begin = split(count, participants, i);
+                ranges[i].end = split(count, participants, i + 1);
+            }
+
+            pthread_mutex_lock(&mutex);
+            current_body = body;
+            current_captures = captures;
+            running = worker_count;
+            ++generation;
+            pthread_cond_broadcast(&start);
+            pthread_mutex_unlock(&mutex);
+
+            work(worker_count);
+
+            pthread_mutex_lock(&mutex);
+            while (running) {
+                pthread_cond_wait(&done, &mutex);
+            }
+            pthread_mutex_unlock(&mutex);
+            pthread_mutex_unlock(&busy);
+        }
+
+    private:
+        /**
+         * @brief スレッドに割り当てられた繰り返しの範囲 [begin, end)
+         */
+        struct range {
+            pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+            std::uint64_t begin = 0;
+            std::uint64_t end = 0;
+        };
+
+        pthread_mutex_t busy = PTHREAD_MUTEX_INITIALIZER;  ///< 繰り返しを実行中であることを表すロック
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; ///< 以下のメンバを保護するロック
+        pthread_cond_t start = PTHREAD_COND_INITIALIZER;   ///< 新しい繰り返しの開始を通知する
+        pthread_cond_t done = PTHREAD_COND_INITIALIZER;    ///< ワーカースレッドの終了を通知する
+        std::uint64_t generation = 0;                      ///< 開始された繰り返しの数
+        std::size_t running = 0;                           ///< 実行中のワーカースレッドの数
+        body_type current_body = nullptr;
+        void *current_captures = nullptr;
+
+        bool started = false;
+        std::size_t worker_count = 0;
+        pthread_t workers[max_workers];
+        range ranges[max_workers + 1]; ///< 最後の要素は呼び出し元のスレッドの範囲
+
+        /**
+         * @brief count 回の繰り返しを parts 個に等分したときの i 番目の区切り
+         */
+        static std::uint64_t split(std::uint64_t count, std::uint64_t parts, std::uint64_t i)
+        {
+            return count / parts * i + (i < count % parts ? i : count % parts);
+        }
+
+        static void run_serially(body_type body, void *captures, std::uint64_t count)
+        {
+            for (std::uint64_t index = 0; index < count; ++index) {
+                body(captures, index);
+            }
+        }
+
+        /**
+         * @brief ワーカースレッドを生成する
+         */
+        void spawn()
+        {
+            started = true;
+            long count = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+            if (const char *threads = std::getenv("LOOPER_THREADS")) {
+                count = std::atol(threads) - 1;
+            }
+            count = count < 0 ? 0 : count > long(max_workers) ? long(max_workers) : count;
+            for (std::size_t i = 0; i < std::size_t(count); ++i) {
+                if (pthread_create(&workers[i], nullptr, worker_main, reinterpret_cast<void *>(i)) != 0) {
+                    break;
+                }
+                ++worker_count;
+            }
+        }
+
+        static void *worker_main(void *argument);
+
+        /**
+         * @brief 実行すべき繰り返しがなくなるまで繰り返しを実行する
+         * @param self 呼び出したスレッドの番号
+         */
+        void work(std::size_t self)
+        {
+            for (;;) {
+                std::uint64_t index;
+                if (take(ranges[self], index)) {
+                    current_body(current_captures, index);
+                } else if (!steal(self)) {
+                    return;
+                }
+            }
+        }
+
+        /**
+         * @brief 範囲の先頭から繰り返しを一つ取り出す
+         */
+        static bool take(range &range, std::uint64_t &index)
+        {
+            pthread_mutex_lock(&range.mutex);
+            bool found = range.begin < range.end;
+            if (found) {
+                index = range.begin++;
+            }
+            pthread_mutex_unlock(&range.mutex);
+            return found;
+        }
+
+        /**
+         * @brief 他のスレッドの範囲の後ろ半分を自分の範囲に移す
+         * @return 移すことのできる範囲があったか
+         */
+        bool steal(std::size_t self)
+        {
+            auto participants = worker_count + 1;
+            for (std::size_t offset = 1; offset < participants; ++offset) {
+                auto &victim = ranges[(self + offset) % participants];
+                pthread_mutex_lock(&victim.mutex);
+                if (victim.begin >= victim.end) {
+                    pthread_mutex_unlock(&victim.mutex);
+                    continue;
+                }
+                auto end = victim.end;
+                victim.end -= (victim.end - victim.begin + 1) / 2;
+                auto begin = victim.end;
+                pthread_mutex_unlock(&victim.mutex);
+
+                pthread_mutex_lock(&ranges[self].mutex);
+                ranges[self].begin = begin;
+                ranges[self].end = end;
+                pthread_mutex_unlock(&ranges[self].mutex);
+                return true;
+            }
+            return false;
+        }
+    };
+
+    /**
+     * @brief looper_parallel 関数が用いるスレッドプール
+     */
+    inline pool instance;
+
+    /**
+     * @brief ワーカースレッドの処理
+     * @param argument ワーカースレッドの番号
+     */
+    inline void *pool::worker_main(void *argument)
+    {
+        auto self = reinterpret_cast<std::size_t>(argument);
+        std::uint64_t seen = 0;
+        pthread_mutex_lock(&instance.mutex);
+        for (;;) {
+            while (instance.generation == seen) {
+                pthread_cond_wait(&instance.start, &instance.mutex);
+            }
+            seen = instance.generation;
+            pthread_mutex_unlock(&instance.mutex);
+
+            instance.work(self);
+
+            pthread_mutex_lock(&instance.mutex);
+            if (--instance.running == 0) {
+                pthread_cond_signal(&instance.done);
+            }
+        }
+    }
+}
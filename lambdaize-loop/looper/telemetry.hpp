@@ -0,0 +1,293 @@
+/**
+ * @file telemetry.hpp
+ * @brief looper 関数の実行状況の計測
+ * @details LOOPER_TELEMETRY を定義してビルドした場合のみ計測を行い、
+ * @details 環境変数 LOOPER_TELEMETRY_FILE が設定されていれば終了時にその結果を CSV 形式で書き出す
+ * @details LOOPER_TELEMETRY_FILE に "-" を指定した場合は標準エラー出力に書き出す
+ * @details 計測結果はパスが lambdaize_loops セクションに書き出したループの識別子（ソース上の位置など）ごとにまとめ、
+ * @details 識別子が見つからない loopee はそのアドレスで区別する
+ */
+
+#ifdef LOOPER_TELEMETRY
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * @brief パスが lambdaize_loops セクションに書き出す、loopee とループの識別子の組
+ */
+struct lambdaize_loop_id {
+    const void *loopee; ///< extracted 関数へのポインタ
+    const char *id;     ///< ループの識別子（"ファイル名:行:列" もしくは "関数名#ループの番号"）
+};
+
+/**
+ * @brief lambdaize_loops セクションの先頭と末尾（リンカが定義する）
+ * @note セクションがない場合（パスが識別子を書き出していない場合や ELF 以外の場合）は weak 参照により nullptr となる
+ */
+extern "C" const lambdaize_loop_id __start_lambdaize_loops[] __attribute__((weak, visibility("hidden")));
+extern "C" const lambdaize_loop_id __stop_lambdaize_loops[] __attribute__((weak, visibility("hidden")));
+
+namespace telemetry {
+    /**
+     * @brief loopee ごとの計測結果
+     */
+    struct record {
+        std::atomic<const void *> loopee;               ///< 計測対象の loopee
+        std::atomic<const char *> id;                   ///< loopee に対応するループの識別子（見つからない場合は nullptr）
+        std::atomic<unsigned long long> calls;          ///< looper 関数が呼び出された回数
+        std::atomic<unsigned long long> iterations;     ///< loopee が呼び出された回数
+        std::atomic<unsigned long long> fallbacks;      ///< 再帰回数が上限に達して simple_while に移行した回数
+        std::atomic<unsigned long long> cycles;         ///< looper 関数の中で費やされたサイクル数（内側の looper 関数の分も含む）
+        std::atomic<unsigned long long> max_stack;      ///< looper 関数の入口から loopee の呼び出しまでに使われたスタックの最大量（バイト）
+    };
+
+    /**
+     * @brief 計測できる loopee の最大数
+     */
+    constexpr std::size_t capacity = 4096;
+
+    /**
+     * @brief 計測結果を保持するハッシュ表
+     * @note 動的確保を避けるため静的な領域に確保し、ロックを使わずに開番地法で登録する
+     */
+    inline record records[capacity];
+
+    /**
+     * @brief 現在のスレッドで実行中の looper 関数に対応する計測結果
+     */
+    inline thread_local record *current = nullptr;
+
+    /**
+     * @brief 現在のスレッドで実行中の looper 関数の入口でのスタックの位置
+     */
+    inline thread_local char *base = nullptr;
+
+    /**
+     * @brief サイクル数を読み出す
+     * @note サイクルカウンタを読み出す組み込み関数がない場合は、代わりに経過時間をナノ秒単位で返す
+     */
+    inline unsigned long long read_cycle_counter()
+    {
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_readcyclecounter)
+        return __builtin_readcyclecounter();
+#endif
+#endif
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    /**
+     * @brief loopee に対応するループの識別子を lambdaize_loops セクションから探す
+     * @param loopee 計測対象の loopee
+     * @return ループの識別子、見つからない場合は nullptr
+     * @note lambdaize-merge でまとめられたループも、ループごとに識別子を持つ関数が残るので loopee と識別子は一対一に対応する
+     */
+    inline const char *find_id(const void *loopee)
+    {
+        if (!__start_lambdaize_loops) {
+            return nullptr;
+        }
+        for (auto *entry = __start_lambdaize_loops; entry != __stop_lambdaize_loops; ++entry) {
+            if (entry->loopee == loopee) {
+                return entry->id;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief loopee に対応する計測結果を取得する
+     * @param loopee 計測対象の loopee
+     * @return 計測結果へのポインタ、表がいっぱいの場合は nullptr
+     */
+    inline record *find(const void *loopee)
+    {
+        auto hash = reinterpret_cast<std::size_t>(loopee) >> 4;
+        for (std::size_t i = 0; i < capacity; ++i) {
+            auto &slot = records[(hash + i) % capacity];
+            const void *expected = nullptr;
+            if (slot.loopee.compare_exchange_strong(expected, loopee)) {
+                // 識別子の検索は loopee ごとに一度だけ行う
+                slot.id.store(find_id(loopee), std::memory_order_release);
+                return &slot;
+            }
+            if (expected == loopee) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief looper 関数の呼び出し一回分の計測を行う
+     */
+    class scope {
+    public:
+        explicit scope(const void *loopee)
+            : previous(current), previous_base(base), start(read_cycle_counter())
+        {
+            base = static_cast<char *>(__builtin_frame_address(0));
+            if ((current = find(loopee))) {
+                current->calls.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        ~scope()
+        {
+            if (current) {
+                current->cycles.fetch_add(read_cycle_counter() - start, std::memory_order_relaxed);
+            }
+            current = previous;
+            base = previous_base;
+        }
+
+        scope(const scope &) = delete;
+        scope &operator=(const scope &) = delete;
+
+    private:
+        record *previous;
+        char *previous_base;
+        unsigned long long start;
+    };
+
+    /**
+     * @brief loopee の呼び出しを一回記録する
+     */
+    inline void count_iteration()
+    {
+        if (current) {
+            current->iterations.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief loopee の呼び出しをまとめて記録する
+     * @param count 記録する呼び出しの回数
+     */
+    inline void count_iterations(unsigned long long count)
+    {
+        if (current) {
+            current->iterations.fetch_add(count, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief loopee を呼び出す直前のスタックの位置を記録する
+     * @param frame 呼び出し元のフレームの位置
+     * @note 再帰を行う looper 関数では再帰が深くなるほど looper 関数の入口から遠ざかる
+     */
+    inline void observe_stack(const char *frame)
+    {
+        if (current && frame < base) {
+            auto used = static_cast<unsigned long long>(base - frame);
+            auto max = current->max_stack.load(std::memory_order_relaxed);
+            while (used > max && !current->max_stack.compare_exchange_weak(max, used, std::memory_order_relaxed));
+        }
+    }
+
+    /**
+     * @brief simple_while への移行を一回記録する
+     */
+    inline void count_fallback()
+    {
+        if (current) {
+            current->fallbacks.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief 二つの計測結果が同じループのものであるか判定する
+     * @note 識別子を持つもの同士は識別子で、そうでないものは loopee で比べる
+     */
+    inline bool same_loop(const record &lhs, const record &rhs)
+    {
+        auto *lhs_id = lhs.id.load(std::memory_order_acquire), *rhs_id = rhs.id.load(std::memory_order_acquire);
+        if (lhs_id && rhs_id) {
+            return std::strcmp(lhs_id, rhs_id) == 0;
+        }
+        return !lhs_id && !rhs_id && lhs.loopee.load() == rhs.loopee.load();
+    }
+
+    /**
+     * @brief 終了時に計測結果を書き出す
+     * @details 同じ識別子を持つ loopee（インライン展開で複製されたループなど）の計測結果は一行にまとめる
+     */
+    inline struct dumper {
+        ~dumper()
+        {
+            const char *path = std::getenv("LOOPER_TELEMETRY_FILE");
+            if (!path) {
+                return;
+            }
+            bool to_stderr = std::strcmp(path, "-") == 0;
+            std::FILE *file = to_stderr ? stderr : std::fopen(path, "w");
+            if (!file) {
+                return;
+            }
+            std::fprintf(file, "loop,calls,iterations,fallbacks,cycles,cycles_per_call,cycles_per_iteration,max_stack\n");
+            for (std::size_t i = 0; i < capacity; ++i) {
+                auto &slot = records[i];
+                if (!slot.loopee.load() ||
+                    std::any_of(records, records + i, [&](auto &&other) { return other.loopee.load() && same_loop(other, slot); })) {
+                    continue;
+                }
+                unsigned long long calls = 0, iterations = 0, fallbacks = 0, cycles = 0, max_stack = 0;
+                std::for_each(records + i, records + capacity, [&](auto &&other) {
+                    if (other.loopee.load() && same_loop(other, slot)) {
+                        calls += other.calls.load();
+                        iterations += other.iterations.load();
+                        fallbacks += other.fallbacks.load();
+                        cycles += other.cycles.load();
+                        max_stack = std::max(max_stack, other.max_stack.load());
+                    }
+                });
+                // 識別子はファイル名を含みうるため、CSV のフィールドとして引用符で囲む
+                if (auto *id = slot.id.load(std::memory_order_acquire)) {
+                    std::fputc('"', file);
+                    for (; *id; ++id) {
+                        if (*id == '"') {
+                            std::fputc('"', file);
+                        }
+                        std::fputc(*id, file);
+                    }
+                    std::fputc('"', file);
+                } else {
+                    std::fprintf(file, "%p", slot.loopee.load());
+                }
+                std::fprintf(file, ",%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+                             calls, iterations, fallbacks, cycles,
+                             calls ? cycles / calls : 0, iterations ? cycles / iterations : 0, max_stack);
+            }
+            if (!to_stderr) {
+                std::fclose(file);
+            }
+        }
+    } dumper_instance;
+}
+
+#else
+
+namespace telemetry {
+    /**
+     * @brief 計測を行わない場合の空の実装
+     */
+    class scope {
+    public:
+        explicit scope(const void *) {}
+    };
+
+    inline void count_iteration() {}
+    inline void count_iterations(unsigned long long) {}
+    inline void observe_stack(const char *) {}
+    inline void count_fallback() {}
+}
+
+#endif
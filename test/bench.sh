@@ -0,0 +1,112 @@
+#!/bin/bash -e
+SCRIPTDIR=$(dirname "$(realpath "$0")")
+set -o pipefail
+PASSDIR=$(realpath "$SCRIPTDIR/../lambdaize-loop")
+BENCHDIR=$SCRIPTDIR/bench-build
+REPEAT=10
+INPUT=/bin/ls
+PROBS="0.25 0.5 0.75"
+STRATEGIES="while one-deduced multiple-deduced trampoline"
+RECURSION_COUNTS="256 8192 65536 auto"
+while getopts n:i:p:l:r: OPT
+do
+    case $OPT in
+        "n" ) REPEAT="$OPTARG" ;;
+        "i" ) INPUT="$OPTARG" ;;
+        "p" ) PROBS="$OPTARG" ;;
+        "l" ) STRATEGIES="$OPTARG" ;;
+        "r" ) RECURSION_COUNTS="$OPTARG" ;;
+         *  ) echo "usage: $0 [-n REPEAT] [-i INPUT] [-p PROBS] [-l STRATEGIES] [-r RECURSION_COUNTS] [SOURCE...]"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    set -- sha256.cpp single_nested_loop.c double_nested_loop.c triple_nested_loop.c \
+           quadruple_nested_loop.c sextuple_nested_loop.c
+fi
+
+# NAME;PASSFLAGS;LINKLOOPER;LOOPER_STRATEGY;LOOPER_MAX_RECURSION
+# runtime-* variants switch the strategy of the runtime looper (and its recursion count) through the environment
+VARIANTS=("original;;;;")
+for LOOPER in runtime while recursive tailrec; do
+    if [ "$LOOPER" = runtime ]; then
+        VARIANTS+=("$LOOPER;-lambdaize-looper=$LOOPER;yes;;")
+    else
+        VARIANTS+=("$LOOPER;-lambdaize-looper=$LOOPER;no;;")
+    fi
+done
+for PROB in $PROBS; do
+    VARIANTS+=("prob-$PROB;-prob=$PROB;yes;;")
+done
+for STRATEGY in $STRATEGIES; do
+    if [ "$STRATEGY" = while ] || [ "$STRATEGY" = trampoline ]; then
+        VARIANTS+=("runtime-$STRATEGY;;yes;$STRATEGY;")
+        continue
+    fi
+    for COUNT in $RECURSION_COUNTS; do
+        VARIANTS+=("runtime-$STRATEGY-max-recursion-$COUNT;;yes;$STRATEGY;$COUNT")
+    done
+done
+for COUNT in $RECURSION_COUNTS; do
+    if [ "$COUNT" != auto ]; then
+        VARIANTS+=("recursive-max-recursion-$COUNT;-lambdaize-looper=recursive -lambdaize-max-recursion=$COUNT;no;;")
+    fi
+done
+
+make --directory="$SCRIPTDIR" --no-print-directory measure >&2
+
+# build SOURCE as VARIANT and print the path of the executable
+build() {
+    local NAME PASSFLAGS LINKLOOPER
+    IFS=';' read -r NAME PASSFLAGS LINKLOOPER _ <<< "$1"
+    local BASENAME=${2%.*}
+    local DIR=$BENCHDIR/$NAME
+    local EXE=$BASENAME.obfuscated.out
+    mkdir -p "$DIR"
+    if [ "$NAME" = original ]; then
+        EXE=$BASENAME.out
+    fi
+    make --directory="$DIR" --makefile="$SCRIPTDIR/Makefile" --no-print-directory \
+         VPATH="$SCRIPTDIR" PASSDIR="$PASSDIR" PASSFLAGS="$PASSFLAGS" LINKLOOPER="$LINKLOOPER" \
+         LOOPERBC="$BENCHDIR/looper.bc" "$EXE" >&2
+    echo "$DIR/$EXE"
+}
+
+# read "TIME RSS" lines and print the statistics as JSON members
+statistics() {
+    sort -n | awk '
+        { time[NR] = $1; sum += $1; if ($2 > rss) rss = $2 }
+        END {
+            median = NR % 2 ? time[(NR + 1) / 2] : (time[NR / 2] + time[NR / 2 + 1]) / 2
+            rank = int(0.95 * NR); if (rank < 0.95 * NR) ++rank
+            mean = sum / NR
+            for (i = 1; i <= NR; ++i) squares += (time[i] - mean) ^ 2
+            stddev = NR > 1 ? sqrt(squares / (NR - 1)) : 0
+            printf "\"median\": %.9f, \"p95\": %.9f, \"stddev\": %.9f, \"max_rss_kb\": %d", median, time[rank], stddev, rss
+        }'
+}
+
+FIRST=yes
+echo "{\"repeat\": $REPEAT, \"results\": ["
+for SOURCE in "$@"; do
+    SOURCE=$(basename "$SOURCE")
+    ARGS=()
+    if [ "$SOURCE" = sha256.cpp ]; then
+        ARGS=("$(realpath "$INPUT")")
+    fi
+    for VARIANT in "${VARIANTS[@]}"; do
+        EXE=$(build "$VARIANT" "$SOURCE")
+        IFS=';' read -r NAME PASSFLAGS _ STRATEGY COUNT <<< "$VARIANT"
+        ENV=()
+        [ -z "$STRATEGY" ] || ENV+=(LOOPER_STRATEGY="$STRATEGY")
+        [ -z "$COUNT" ] || ENV+=(LOOPER_MAX_RECURSION="$COUNT")
+        echo "running $EXE ${ENV[*]}" >&2
+        STATS=$(for ((i = 0; i < REPEAT; ++i)); do env "${ENV[@]}" "$SCRIPTDIR/measure" "$EXE" "${ARGS[@]}"; done | statistics)
+        [ "$FIRST" = yes ] || echo ","
+        FIRST=no
+        printf '  {"program": "%s", "variant": "%s", "passflags": "%s", "strategy": "%s", "max_recursion_count": "%s", %s}' \
+               "${SOURCE%.*}" "$NAME" "$PASSFLAGS" "$STRATEGY" "$COUNT" "$STATS"
+    done
+done
+echo
+echo "]}"
@@ -0,0 +1,100 @@
+#!/bin/bash -e
+# lambdaize-loop パスのコンパイル時間が入力の大きさに対してほぼ線形に伸びることを確かめる
+SCRIPTDIR=$(dirname "$(realpath "$0")")
+PASSDIR=$SCRIPTDIR/../lambdaize-loop
+BLOCKS=20000
+CAPTURES=5000
+SCALE=4
+SLACK=2
+DEPTH=16
+while getopts b:c:s:r:d: OPT
+do
+    case $OPT in
+        "b" ) BLOCKS="$OPTARG" ;;
+        "c" ) CAPTURES="$OPTARG" ;;
+        "s" ) SCALE="$OPTARG" ;;
+        "r" ) SLACK="$OPTARG" ;;
+        "d" ) DEPTH="$OPTARG" ;;
+         *  ) echo "usage: $0 [-b BLOCKS] [-c CAPTURES] [-s SCALE] [-r SLACK] [-d DEPTH]"; exit 1 ;;
+    esac
+done
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+# DEPTH 重に入れ子になったループの最も内側に、BLOCKS 個の条件分岐と、その中で使われる CAPTURES 個のループ外の変数を持つ IR を生成する
+generate() {
+    awk -v BLOCKS="$1" -v CAPTURES="$2" -v DEPTH="$3" 'BEGIN {
+        print "define i32 @f(i32 %n, ptr %p) {"
+        print "entry:"
+        for (l = 0; l < DEPTH; ++l) printf "  %%i%d = alloca i32\n", l
+        for (c = 0; c < CAPTURES; ++c) printf "  %%c%d = add i32 %%n, %d\n", c, c
+        print "  br label %preheader0"
+        for (l = 0; l < DEPTH; ++l) {
+            printf "preheader%d:\n", l
+            printf "  store i32 0, ptr %%i%d\n", l
+            printf "  br label %%header%d\n", l
+            printf "header%d:\n", l
+            printf "  %%iv%d = load i32, ptr %%i%d\n", l, l
+            printf "  %%cond%d = icmp slt i32 %%iv%d, %%n\n", l, l
+            printf "  br i1 %%cond%d, label %%%s, label %%exit%d\n", l, (l + 1 < DEPTH ? "preheader" (l + 1) : "b0"), l
+        }
+        for (b = 0; b < BLOCKS; ++b) {
+            c = b % CAPTURES
+            printf "b%d:\n", b
+            printf "  %%x%d = load i32, ptr %%p\n", b
+            printf "  %%y%d = add i32 %%x%d, %%c%d\n", b, b, c
+            printf "  store i32 %%y%d, ptr %%p\n", b
+            printf "  %%t%d = icmp eq i32 %%y%d, %d\n", b, b, b
+            printf "  br i1 %%t%d, label %%s%d, label %%b%d\n", b, b, b + 1
+            printf "s%d:\n", b
+            printf "  store i32 %%c%d, ptr %%p\n", c
+            printf "  br label %%b%d\n", b + 1
+        }
+        printf "b%d:\n", BLOCKS
+        printf "  br label %%latch%d\n", DEPTH - 1
+        for (l = DEPTH - 1; l >= 0; --l) {
+            printf "latch%d:\n", l
+            printf "  %%next%d = add i32 %%iv%d, 1\n", l, l
+            printf "  store i32 %%next%d, ptr %%i%d\n", l, l
+            printf "  br label %%header%d\n", l
+            printf "exit%d:\n", l
+            if (l > 0) printf "  br label %%latch%d\n", l - 1
+            else print "  ret i32 0"
+        }
+        print "}"
+    }'
+}
+
+# 入力を生成して opt にかけ、パス自体にかかった時間を秒単位で出力する
+# IR の読み書きにかかる時間は、パスを走らせない opt の実行時間として差し引く
+measure() {
+    generate "$1" "$2" "$3" > "$WORKDIR/input.ll"
+    make --directory="$PASSDIR" --no-print-directory >&2
+    local START=$EPOCHREALTIME
+    opt -S -passes=verify -o "$WORKDIR/output.ll" "$WORKDIR/input.ll"
+    local MIDDLE=$EPOCHREALTIME
+    opt -S -load-pass-plugin "$PASSDIR/lambdaize-loop.so" -passes=lambdaize-loop -all $OPTFLAGS \
+        -o "$WORKDIR/output.ll" "$WORKDIR/input.ll"
+    local FINISH=$EPOCHREALTIME
+    awk -v START="$START" -v MIDDLE="$MIDDLE" -v FINISH="$FINISH" \
+        'BEGIN { pass = (FINISH - MIDDLE) - (MIDDLE - START); printf "%.6f\n", (pass > 0 ? pass : 0) }'
+}
+
+# 一重のループと DEPTH 重の入れ子のそれぞれについて、入力を SCALE 倍にしたときのコンパイル時間の伸びを調べる
+# 入れ子の場合は内側のループのブロックを外側のループの分として何度も走査すると、深さに比例して遅くなる
+FAILED=0
+for D in 1 "$DEPTH"; do
+    SMALL=$(measure "$BLOCKS" "$CAPTURES" "$D")
+    LARGE=$(measure $((BLOCKS * SCALE)) $((CAPTURES * SCALE)) "$D")
+    echo "depth=$D blocks=$BLOCKS captures=$CAPTURES: ${SMALL}s"
+    echo "depth=$D blocks=$((BLOCKS * SCALE)) captures=$((CAPTURES * SCALE)): ${LARGE}s"
+    if awk -v SMALL="$SMALL" -v LARGE="$LARGE" -v LIMIT="$((SCALE * SLACK))" \
+           'BEGIN { exit !(LARGE > SMALL * LIMIT) }'; then
+        echo -e "\e[31mCOMPILE TIME GREW FASTER THAN EXPECTED\e[m"
+        FAILED=1
+    fi
+done
+if [ "$FAILED" -ne 0 ]; then
+    exit 1
+fi
+echo -e '\e[32mTEST SUCCEEDED\e[m'
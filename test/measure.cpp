@@ -0,0 +1,37 @@
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* run a command once with its output discarded and print its wall time in seconds and peak RSS in KiB */
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s COMMAND [ARGS...]\n", argv[0]);
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execv(argv[1], argv + 1);
+        std::perror(argv[1]);
+        _exit(127);
+    }
+    int status;
+    rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        std::perror("wait4");
+        return 1;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::printf("%.9f %ld\n", elapsed.count(), usage.ru_maxrss);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+
+__attribute__((noinline)) static int f(int n)
+{
+    int sum = 0;
+    __attribute__((lambdaize_loop))
+    for (int i = 0; i < n; ++i) {
+        sum += i;
+    }
+    return sum;
+}
+
+__attribute__((noinline)) static int g(int n)
+{
+    int sum = 0;
+    __attribute__((lambdaize_loop))
+    for (int i = 0; i < n; ++i) {
+        sum += i;
+    }
+    return sum;
+}
+
+int main()
+{
+    printf("%d %d\n", f(100), g(70));
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+/* count every dynamic allocation, including ones made inside looper */
+static std::size_t allocation_count = 0;
+
+void *operator new(std::size_t size)
+{
+    ++allocation_count;
+    if (void *ptr = std::malloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+int main()
+{
+    /* run more iterations than LOOPER_MAX_RECURSION so that the recursive strategies also fall back to the while loop */
+    /* the strategy is chosen by LOOPER_STRATEGY, and `make no-allocation` runs this once per strategy */
+    unsigned sum = 0;
+    std::size_t before = allocation_count;
+    __attribute__((lambdaize_loop))
+    for (unsigned i = 0; i < 100000; ++i) {
+        sum += i;
+    }
+    std::size_t after = allocation_count;
+    std::printf("%u\n", sum);
+    std::printf("allocations: %zu\n", after - before);
+    return after != before;
+}
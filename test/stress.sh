@@ -0,0 +1,249 @@
+#!/bin/bash -e
+SCRIPTDIR=$(dirname "$(realpath "$0")")
+set -o pipefail
+PASSDIR=$(realpath "$SCRIPTDIR/../lambdaize-loop")
+STRESSDIR=$SCRIPTDIR/stress-build
+STRATEGIES="while one-deduced multiple-deduced trampoline"
+# a finite count exercises -lambdaize-looper=recursive and the fallback to the while loop, and is small enough for 32 KiB stacks
+RECURSION_COUNTS="128 auto"
+SCALE=1
+while getopts l:r:s: OPT
+do
+    case $OPT in
+        "l" ) STRATEGIES="$OPTARG" ;;
+        "r" ) RECURSION_COUNTS="$OPTARG" ;;
+        "s" ) SCALE="$OPTARG" ;;
+         *  ) echo "usage: $0 [-l STRATEGIES] [-r RECURSION_COUNTS] [-s SCALE] [NAME:TRIPS,DEPTH,CAPTURES,THREADS,STACK_KB...]"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    set -- long:4000000,1,2,0,0 deep:200000,6,4,0,0 wide:1000000,2,64,0,0 \
+           threads:1000000,2,8,4,64 tiny-stack:1000000,1,16,8,32
+fi
+
+# write a C program with the given shape to standard output
+# the innermost loop runs TRIPS times and each outer loop runs twice, every loop has the lambdaize_loop attribute
+# the loops are run from the main thread and then from THREADS threads with STACK_KB KiB stacks
+# the stacks are painted beforehand and the bytes used by the loops are written to stderr as "stack NAME BYTES"
+generate() {
+    local TRIPS=$1 DEPTH=$2 CAPTURES=$3 THREADS=$4 STACK_KB=$5
+    local LEVEL CAPTURE INDENT
+    echo "/* generated by stress.sh: trips=$TRIPS depth=$DEPTH captures=$CAPTURES threads=$THREADS stack=${STACK_KB}KiB */"
+    echo "#include <limits.h>"
+    echo "#include <pthread.h>"
+    echo "#include <stdio.h>"
+    echo "#include <stdlib.h>"
+    echo "#include <sys/resource.h>"
+    echo
+    echo "#define STACK_PAINT 0xa5"
+    echo
+    echo "static unsigned char *volatile painted;"
+    echo
+    echo "/* fill SIZE bytes of the stack below the caller with STACK_PAINT and remember the lowest address in painted */"
+    echo "static __attribute__((noinline)) void paint_stack(size_t size)"
+    echo "{"
+    echo "    unsigned char area[size];"
+    echo "    volatile unsigned char *p = area;"
+    echo "    for (size_t i = 0; i < size; ++i) {"
+    echo "        p[i] = STACK_PAINT;"
+    echo "    }"
+    echo "    painted = area;"
+    echo "}"
+    echo
+    echo "/* count the bytes from the first overwritten one up to HIGH */"
+    echo "static size_t used_stack(const volatile unsigned char *low, const volatile unsigned char *high)"
+    echo "{"
+    echo "    while (low < high && *low == STACK_PAINT) {"
+    echo "        ++low;"
+    echo "    }"
+    echo "    return high - low;"
+    echo "}"
+    echo
+    echo "static unsigned long long kernel(unsigned long long seed)"
+    echo "{"
+    echo "    unsigned long long sum = seed;"
+    for ((CAPTURE = 0; CAPTURE < CAPTURES; ++CAPTURE)); do
+        echo "    unsigned long long c$CAPTURE = seed * $((CAPTURE + 3)) + $((CAPTURE * 7 + 1));"
+    done
+    for ((LEVEL = 0; LEVEL < DEPTH; ++LEVEL)); do
+        INDENT=$(printf '%*s' $((LEVEL * 4 + 4)) '')
+        echo "${INDENT}__attribute__((lambdaize_loop))"
+        if [ $LEVEL -eq $((DEPTH - 1)) ]; then
+            echo "${INDENT}for (unsigned long long i$LEVEL = 0; i$LEVEL < ${TRIPS}ULL; ++i$LEVEL) {"
+        else
+            echo "${INDENT}for (unsigned long long i$LEVEL = 0; i$LEVEL < 2; ++i$LEVEL) {"
+        fi
+    done
+    INDENT=$(printf '%*s' $((DEPTH * 4 + 4)) '')
+    echo "${INDENT}sum = sum * 6364136223846793005ULL + i$((DEPTH - 1));"
+    for ((CAPTURE = 0; CAPTURE < CAPTURES; ++CAPTURE)); do
+        echo "${INDENT}sum ^= c$CAPTURE + i$((CAPTURE % DEPTH));"
+    done
+    for ((LEVEL = DEPTH - 1; LEVEL >= 0; --LEVEL)); do
+        echo "$(printf '%*s' $((LEVEL * 4 + 4)) '')}"
+    done
+    echo "    return sum;"
+    echo "}"
+    echo
+    echo "static void *run(void *arg)"
+    echo "{"
+    echo "    unsigned long long *result = arg;"
+    echo "    *result = kernel(*result);"
+    echo "    return NULL;"
+    echo "}"
+    echo
+    echo "int main(void)"
+    echo "{"
+    echo "    /* paint most of the main stack, leaving room for what is already used */"
+    echo "    struct rlimit limit;"
+    echo "    size_t size = 8UL << 20;"
+    echo "    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {"
+    echo "        size = limit.rlim_cur;"
+    echo "    }"
+    echo "    size = (size < 64UL << 20 ? size : 64UL << 20) / 4 * 3;"
+    echo "    paint_stack(size);"
+    echo "    unsigned long long result = kernel(0);"
+    echo "    fprintf(stderr, \"stack main %zu\\n\", used_stack(painted, painted + size));"
+    echo "    printf(\"main %llu\\n\", result);"
+    if [ "$THREADS" -gt 0 ]; then
+        echo "    /* the thread stacks are allocated here so that they can be painted and inspected after join */"
+        echo "    /* glibc keeps the thread descriptor and TLS at the top of them, which is counted as used */"
+        echo "    size_t stack_size = ${STACK_KB}UL * 1024 < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : ${STACK_KB}UL * 1024;"
+        echo "    pthread_t threads[$THREADS];"
+        echo "    unsigned long long results[$THREADS];"
+        echo "    unsigned char *stacks[$THREADS];"
+        echo "    pthread_attr_t attr;"
+        echo "    pthread_attr_init(&attr);"
+        echo "    for (int t = 0; t < $THREADS; ++t) {"
+        echo "        results[t] = t + 1;"
+        echo "        if (posix_memalign((void **)&stacks[t], 4096, stack_size) != 0) {"
+        echo "            return 1;"
+        echo "        }"
+        echo "        for (size_t i = 0; i < stack_size; ++i) {"
+        echo "            ((volatile unsigned char *)stacks[t])[i] = STACK_PAINT;"
+        echo "        }"
+        echo "        pthread_attr_setstack(&attr, stacks[t], stack_size);"
+        echo "        if (pthread_create(&threads[t], &attr, run, &results[t]) != 0) {"
+        echo "            return 1;"
+        echo "        }"
+        echo "    }"
+        echo "    for (int t = 0; t < $THREADS; ++t) {"
+        echo "        pthread_join(threads[t], NULL);"
+        echo "        fprintf(stderr, \"stack thread%d %zu\\n\", t, used_stack(stacks[t], stacks[t] + stack_size));"
+        echo "        printf(\"thread%d %llu\\n\", t, results[t]);"
+        echo "        free(stacks[t]);"
+        echo "    }"
+    fi
+    echo "    return 0;"
+    echo "}"
+}
+
+# NAME;PASSFLAGS;LINKLOOPER;LOOPER_STRATEGY;LOOPER_MAX_RECURSION
+# runtime-* variants use one telemetry-enabled build and switch the strategy through the environment
+VARIANTS=()
+for STRATEGY in $STRATEGIES; do
+    if [ "$STRATEGY" = while ] || [ "$STRATEGY" = trampoline ]; then
+        VARIANTS+=("runtime-$STRATEGY;;yes;$STRATEGY;")
+        continue
+    fi
+    for COUNT in $RECURSION_COUNTS; do
+        VARIANTS+=("runtime-$STRATEGY-max-recursion-$COUNT;;yes;$STRATEGY;$COUNT")
+    done
+done
+VARIANTS+=("while;-lambdaize-looper=while;no;;" "tailrec;-lambdaize-looper=tailrec;no;;")
+for COUNT in $RECURSION_COUNTS; do
+    if [ "$COUNT" != auto ]; then
+        VARIANTS+=("recursive-max-recursion-$COUNT;-lambdaize-looper=recursive -lambdaize-max-recursion=$COUNT;no;;")
+    fi
+done
+
+# build EXE as VARIANT and print the path of the executable
+# variants linked with looper.bc differ only in the environment, so they share one build
+build() {
+    local NAME PASSFLAGS LINKLOOPER
+    IFS=';' read -r NAME PASSFLAGS LINKLOOPER _ <<< "$1"
+    local DIR=$STRESSDIR/$NAME
+    if [ "$LINKLOOPER" = yes ]; then
+        DIR=$STRESSDIR/runtime
+    fi
+    mkdir -p "$DIR"
+    make --directory="$DIR" --makefile="$SCRIPTDIR/Makefile" --no-print-directory \
+         VPATH="$STRESSDIR" PASSDIR="$PASSDIR" PASSFLAGS="$PASSFLAGS" LINKLOOPER="$LINKLOOPER" \
+         LOOPERBC="$STRESSDIR/looper.bc" LOOPERFLAGS="TELEMETRY=yes" "$2" >&2
+    echo "$DIR/$2"
+}
+
+# read the telemetry CSV and print the totals as JSON members
+# the quoted loop ID in the first column may contain commas, so the numeric columns are counted from the end
+summarize() {
+    awk -F, '
+        NR > 1 { iterations += $(NF - 5); fallbacks += $(NF - 4); if ($NF > stack) stack = $NF }
+        END { printf "\"iterations\": %d, \"fallbacks\": %d, \"looper_max_stack\": %d", iterations, fallbacks, stack }' "$1"
+}
+
+# read the "stack NAME BYTES" lines written by the program and print the largest as a JSON member
+measure_stack() {
+    awk '$1 == "stack" && $3 > stack { stack = $3; found = 1 }
+         END { if (found) printf "\"max_stack\": %d", stack; else printf "\"max_stack\": null" }' "$1"
+}
+
+FAILED=no
+FIRST=yes
+mkdir -p "$STRESSDIR/results"
+echo "{\"scale\": $SCALE, \"results\": ["
+for SPEC in "$@"; do
+    PROGRAM=${SPEC%%:*}
+    IFS=',' read -r TRIPS DEPTH CAPTURES THREADS STACK_KB <<< "${SPEC#*:}"
+    TRIPS=$(awk -v trips="$TRIPS" -v scale="$SCALE" 'BEGIN { printf "%d", trips * scale }')
+    generate "$TRIPS" "$DEPTH" "$CAPTURES" "$THREADS" "$STACK_KB" > "$STRESSDIR/$PROGRAM.c.new"
+    # keep the timestamp when nothing changed so that make does not rebuild every variant
+    if cmp -s "$STRESSDIR/$PROGRAM.c.new" "$STRESSDIR/$PROGRAM.c"; then
+        rm "$STRESSDIR/$PROGRAM.c.new"
+    else
+        mv "$STRESSDIR/$PROGRAM.c.new" "$STRESSDIR/$PROGRAM.c"
+    fi
+    ORIGINAL=$(build "original;;;;" "$PROGRAM.out")
+    "$ORIGINAL" > "$STRESSDIR/$PROGRAM.expected"
+    # every iteration of the innermost loop and every iteration of the outer loops, from the main thread and each thread
+    ITERATIONS=$(awk -v trips="$TRIPS" -v depth="$DEPTH" -v threads="$THREADS" \
+                     'BEGIN { n = 0; outer = 1; for (i = 1; i < depth; ++i) { n += outer * 2; outer *= 2 } printf "%d", (n + outer * trips) * (threads + 1) }')
+    for VARIANT in "${VARIANTS[@]}"; do
+        IFS=';' read -r NAME PASSFLAGS LINKLOOPER STRATEGY COUNT <<< "$VARIANT"
+        EXE=$(build "$VARIANT" "$PROGRAM.obfuscated.out")
+        TELEMETRY=$STRESSDIR/results/$PROGRAM.$NAME.telemetry.csv
+        OUTPUT=$STRESSDIR/results/$PROGRAM.$NAME.out
+        STACK=$STRESSDIR/results/$PROGRAM.$NAME.stack
+        ENV=(LOOPER_TELEMETRY_FILE="$TELEMETRY")
+        [ -z "$STRATEGY" ] || ENV+=(LOOPER_STRATEGY="$STRATEGY")
+        [ -z "$COUNT" ] || ENV+=(LOOPER_MAX_RECURSION="$COUNT")
+        rm -f "$TELEMETRY"
+        echo "running $EXE ${ENV[*]}" >&2
+        START=$(date +%s%N)
+        STATUS=passed
+        env "${ENV[@]}" "$EXE" > "$OUTPUT" 2> "$STACK" || STATUS=crashed
+        END=$(date +%s%N)
+        if [ "$STATUS" = passed ] && ! diff -q "$STRESSDIR/$PROGRAM.expected" "$OUTPUT" > /dev/null; then
+            STATUS=mismatched
+        fi
+        [ "$STATUS" = passed ] || FAILED=yes
+        TELEMETRY_STATS="\"iterations\": null, \"fallbacks\": null, \"looper_max_stack\": null"
+        if [ -f "$TELEMETRY" ]; then
+            TELEMETRY_STATS=$(summarize "$TELEMETRY")
+        fi
+        [ "$FIRST" = yes ] || echo ","
+        FIRST=no
+        printf '  {"program": "%s", "variant": "%s", "passflags": "%s", "strategy": "%s", "max_recursion_count": "%s", ' \
+               "$PROGRAM" "$NAME" "$PASSFLAGS" "$STRATEGY" "$COUNT"
+        printf '"status": "%s", %s, %s, %s}' "$STATUS" \
+               "$(awk -v ns=$((END - START)) -v n="$ITERATIONS" 'BEGIN { printf "\"seconds\": %.9f, \"ns_per_iteration\": %.3f", ns / 1e9, ns / n }')" \
+               "$(measure_stack "$STACK")" "$TELEMETRY_STATS"
+    done
+done
+echo
+echo "]}"
+if [ "$FAILED" = yes ]; then
+    echo -e '\e[31mSTRESS TEST FAILED\e[m' >&2
+    exit 1
+fi
+echo -e '\e[32mSTRESS TEST SUCCEEDED\e[m' >&2
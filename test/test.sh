@@ -3,6 +3,9 @@ SCRIPTDIR=$(dirname "$(realpath "$0")")
 BASENAME=$(basename "$1")
 ORIGINAL_EXE=${BASENAME%.*}.out
 OBFUSCATED_EXE=${BASENAME%.*}.obfuscated.out
+if [ "$PLUGIN" = yes ]; then
+    OBFUSCATED_EXE=${BASENAME%.*}.plugin.out
+fi
 set -x
 make --directory="$SCRIPTDIR" "$ORIGINAL_EXE"
 make --directory="$SCRIPTDIR" "$OBFUSCATED_EXE"
@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+// a と b が重なりうるため、ループベクトル化は実行時の依存検査を挿入する
+__attribute__((noinline)) static void add(int *a, const int *b, long n)
+{
+    __attribute__((lambdaize_loop))
+    for (long i = 0; i < n; ++i) {
+        a[i] += b[i];
+    }
+}
+
+int main()
+{
+    int a[1003], b[1003], c[1003];
+    for (int i = 0; i < 1003; ++i) {
+        a[i] = i;
+        b[i] = 2 * i;
+        c[i] = i;
+    }
+    add(a, b, 1003);     // 重ならないのでベクトル化されたループ本体と剰余ループで実行される
+    add(c + 1, c, 1002); // 重なるので剰余ループだけで実行される
+    long s = 0, t = 0;
+    for (int i = 0; i < 1003; ++i) {
+        s += a[i];
+        t += c[i] % 7 * (i + 1);
+    }
+    printf("%ld %ld\n", s, t);
+    return 0;
+}
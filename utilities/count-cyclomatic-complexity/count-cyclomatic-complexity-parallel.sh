@@ -0,0 +1,43 @@
+#!/bin/bash -e
+SCRIPTDIR=$(dirname "$(realpath "$0")")
+JOBS=$(nproc)
+OUTPUT=-
+while getopts j:o: OPT
+do
+    case $OPT in
+        "j" ) JOBS="$OPTARG" ;;
+        "o" ) OUTPUT="$OPTARG" ;;
+         *  ) echo "usage: $0 [-j JOBS] [-o OUTPUT] DIRECTORY_OR_FILE..."; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-j JOBS] [-o OUTPUT] DIRECTORY_OR_FILE..."
+    exit 1
+fi
+
+make --directory="$SCRIPTDIR" --no-print-directory >&2
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+# 入力ごとに別のファイルへ JSON を書き出し、失敗した入力は failed.txt に記録する
+export SCRIPTDIR WORKDIR
+find "$@" -type f \( -name '*.bc' -o -name '*.ll' \) -print0 | sort -z |
+xargs -0 -r -n 1 -P "$JOBS" sh -c '
+    RESULT=$(mktemp "$WORKDIR/result.XXXXXX")
+    opt -load-pass-plugin "$SCRIPTDIR"/count-cyclomatic-complexity.so -passes=count-cyclomatic-complexity \
+        -disable-output -complexity-format=json -complexity-output="$RESULT" "$1" ||
+    { rm -f "$RESULT"; echo "$1" >> "$WORKDIR/failed.txt"; }
+' sh || true
+
+# 結果を JSON Lines として連結する（一行が一つのモジュールに対応する）
+if [ "$OUTPUT" = - ]; then
+    find "$WORKDIR" -name 'result.*' -exec cat {} +
+else
+    find "$WORKDIR" -name 'result.*' -exec cat {} + > "$OUTPUT"
+fi
+if [ -s "$WORKDIR/failed.txt" ]; then
+    echo "failed to analyze $(wc -l < "$WORKDIR/failed.txt") file(s):" >&2
+    cat "$WORKDIR/failed.txt" >&2
+    exit 1
+fi
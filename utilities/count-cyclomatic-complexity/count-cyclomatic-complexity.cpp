@@ -3,11 +3,76 @@
  * @brief プログラムの循環的複雑度を求めるパス
  */
 
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "../../lambdaize-loop/attributes.hpp"
+#include "../../lambdaize-loop/cost.hpp"
 
 namespace {
+    /**
+     * @brief 結果の出力形式
+     */
+    enum class Format {
+        Text, ///< モジュール全体の集計のみを標準エラー出力に表示する
+        JSON, ///< 関数ごと、ループごとの集計を含む JSON を一行で出力する
+    };
+
+    llvm::cl::opt<Format> format (
+        "complexity-format",
+        llvm::cl::desc("Output format of count-cyclomatic-complexity"),
+        llvm::cl::values(
+            clEnumValN(Format::Text, "text", "Print module-wide totals to stderr"),
+            clEnumValN(Format::JSON, "json", "Print per-function and per-loop metrics as a single line of JSON")),
+        llvm::cl::init(Format::Text)
+    );
+
+    llvm::cl::opt<std::string> output (
+        "complexity-output",
+        llvm::cl::desc("Output file of the JSON format (\"-\" means stdout)"),
+        llvm::cl::init("-")
+    );
+
+    /**
+     * @brief 基本ブロックの集まりの大きさ
+     */
+    struct GraphSize {
+        int Nodes = 0; ///< 基本ブロック数
+        int Edges = 0; ///< 辺数
+
+        /**
+         * @brief 連結成分がひとつであるとしたときの循環的複雑度
+         */
+        int complexity() const
+        {
+            return Edges - Nodes + 2;
+        }
+    };
+
+    /**
+     * @brief looper 関数の呼び出し（難読化されたループ）
+     */
+    struct LooperCall {
+        llvm::StringRef Looper;    ///< looper 関数の名前
+        llvm::Function *Extracted; ///< 繰り返し呼び出される extracted 関数
+        unsigned Captures;         ///< extracted 関数に渡される変数の数
+        double Overhead;           ///< 繰り返し一回あたりに増えるコストの見積もり
+    };
+
     /**
      * @brief モジュールの循環的複雑度を求める
      * @details モジュール内の辺数を E, 基本ブロック数を V, 関数数を C として、
@@ -17,9 +82,15 @@ namespace {
     public:
         /**
          * @brief 関数数、辺数、基本ブロック数、循環的複雑度を表示する
+         * @note JSON 形式の場合は、関数ごと、ループごとの値と難読化に関する値も出力する
          */
-        llvm::PreservedAnalyses run(llvm::Module &Module, llvm::ModuleAnalysisManager &)
+        llvm::PreservedAnalyses run(llvm::Module &Module, llvm::ModuleAnalysisManager &MAM)
         {
+            if (format == Format::JSON) {
+                writeJSON(Module, MAM);
+                return llvm::PreservedAnalyses::all();
+            }
+
             int ComponentsCount = 0;
             int EdgesSum = 0, NodesSum = 0;
             for (auto &&Function : Module.functions()) {
@@ -35,6 +106,315 @@ namespace {
             llvm::errs() << "Cyclomatic Complexity: " << EdgesSum - NodesSum + 2 * ComponentsCount << '\n';
             return llvm::PreservedAnalyses::all();
         }
+
+    private:
+        /**
+         * @brief モジュールの集計を JSON 形式で出力する
+         * @details 関数の数や循環的複雑度は定義を持つ関数のみを対象とする
+         */
+        void writeJSON(llvm::Module &Module, llvm::ModuleAnalysisManager &MAM)
+        {
+            auto &FAM = MAM.getResult<llvm::FunctionAnalysisManagerModuleProxy>(Module).getManager();
+
+            // extracted 関数かどうかを判定するため、先に looper 関数の呼び出しをすべて集める
+            llvm::DenseMap<llvm::Function *, std::vector<LooperCall>> Calls;
+            llvm::SmallPtrSet<llvm::Function *, 16> Extracted;
+            for (auto &&Function : Module) {
+                for (auto &&Inst : llvm::instructions(Function)) {
+                    if (auto Call = getLooperCall(Inst)) {
+                        if (Call->Extracted) {
+                            Extracted.insert(Call->Extracted);
+                        }
+                        Calls[&Function].push_back(*Call);
+                    }
+                }
+            }
+
+            std::error_code EC;
+            std::unique_ptr<llvm::raw_fd_ostream> File;
+            if (output != "-") {
+                File = std::make_unique<llvm::raw_fd_ostream>(output, EC, llvm::sys::fs::OF_Text);
+                if (EC) {
+                    llvm::report_fatal_error(llvm::Twine("cannot open ") + output + ": " + EC.message());
+                }
+            }
+            auto &OS = File ? *File : llvm::outs();
+
+            GraphSize Total;
+            int FunctionsCount = 0, LooperCallsCount = 0;
+            llvm::json::OStream J(OS);
+            J.object([&] {
+                J.attribute("module", Module.getModuleIdentifier());
+                J.attributeArray("function_list", [&] {
+                    for (auto &&Function : Module) {
+                        if (Function.isDeclaration()) {
+                            continue;
+                        }
+                        auto Size = getFunctionSize(Function);
+                        Total.Nodes += Size.Nodes;
+                        Total.Edges += Size.Edges;
+                        ++FunctionsCount;
+                        LooperCallsCount += Calls.lookup(&Function).size();
+                        writeFunction(J, Function, Size, Extracted.count(&Function), Calls.lookup(&Function), FAM);
+                    }
+                });
+                J.attribute("functions", FunctionsCount);
+                J.attribute("blocks", Total.Nodes);
+                J.attribute("edges", Total.Edges);
+                J.attribute("cyclomatic_complexity", Total.Edges - Total.Nodes + 2 * FunctionsCount);
+                J.attribute("lambdaized_loops", LooperCallsCount);
+                J.attribute("extracted_functions", static_cast<int64_t>(Extracted.size()));
+            });
+            OS << '\n';
+        }
+
+        /**
+         * @brief 関数の集計を JSON 形式で出力する
+         * @param J 出力先
+         * @param Function 対象の関数
+         * @param Size 関数の大きさ
+         * @param IsExtracted 関数が extracted 関数であるか
+         * @param Calls 関数内の looper 関数の呼び出し
+         * @param FAM 関数の解析結果を得るための FunctionAnalysisManager
+         */
+        void writeFunction(llvm::json::OStream &J, llvm::Function &Function, GraphSize Size, bool IsExtracted,
+                           const std::vector<LooperCall> &Calls, llvm::FunctionAnalysisManager &FAM)
+        {
+            J.object([&] {
+                J.attribute("name", Function.getName());
+                J.attribute("blocks", Size.Nodes);
+                J.attribute("edges", Size.Edges);
+                J.attribute("cyclomatic_complexity", Size.complexity());
+                J.attribute("extracted", IsExtracted);
+                J.attribute("lambdaized_loops", static_cast<int64_t>(Calls.size()));
+                J.attributeArray("loops", [&] {
+                    // 合成された looper 関数内のループは難読化によって生じたものなので、元のプログラムのループとしては数えない
+                    if (isSynthesizedLooper(Function)) {
+                        return;
+                    }
+                    for (auto *Loop : FAM.getResult<llvm::LoopAnalysis>(Function).getLoopsInPreorder()) {
+                        if (!isStripMinedLoop(Function, *Loop)) {
+                            writeLoop(J, *Loop);
+                        }
+                    }
+                });
+                J.attributeArray("looper_calls", [&] {
+                    for (auto &&Call : Calls) {
+                        J.object([&] {
+                            J.attribute("looper", Call.Looper);
+                            J.attribute("extracted", Call.Extracted ? Call.Extracted->getName() : llvm::StringRef());
+                            J.attribute("captures", Call.Captures);
+                            J.attribute("estimated_overhead_per_iteration", Call.Overhead);
+                        });
+                    }
+                });
+            });
+        }
+
+        /**
+         * @brief ループの集計を JSON 形式で出力する
+         * @param J 出力先
+         * @param Loop 対象のループ
+         * @details 辺数はループ内のブロック同士を結ぶもの（back edge を含む）のみを数える
+         * @details 見積もりは、lambdaize-loop パスがデフォルトの設定（va_list 渡し、looper.bc の looper 関数）で
+         * @details このループを難読化した場合のものである
+         */
+        void writeLoop(llvm::json::OStream &J, llvm::Loop &Loop)
+        {
+            GraphSize Size;
+            for (auto *Block : Loop.blocks()) {
+                ++Size.Nodes;
+                for (auto *Successor : llvm::successors(Block)) {
+                    Size.Edges += Loop.contains(Successor);
+                }
+            }
+            auto Captures = countCaptures(Loop);
+
+            llvm::SmallString<32> Header;
+            llvm::raw_svector_ostream HeaderOS(Header);
+            Loop.getHeader()->printAsOperand(HeaderOS, false);
+
+            J.object([&] {
+                J.attribute("header", Header);
+                J.attribute("depth", Loop.getLoopDepth());
+                J.attribute("blocks", Size.Nodes);
+                J.attribute("edges", Size.Edges);
+                J.attribute("cyclomatic_complexity", Size.complexity());
+                J.attribute("annotated", LoopContainsMetadata(Loop, "lambdaizeloop"));
+                J.attribute("captures", Captures);
+                J.attribute("estimated_overhead_per_iteration", lambdaize_cost::getOverheadPerIteration("runtime", true, Captures, 1));
+            });
+        }
+
+        /**
+         * @brief 関数の大きさを求める
+         */
+        GraphSize getFunctionSize(llvm::Function &Function)
+        {
+            GraphSize Size;
+            for (auto &&Block : Function) {
+                ++Size.Nodes;
+                Size.Edges += Block.getTerminator()->getNumSuccessors();
+            }
+            return Size;
+        }
+
+        /**
+         * @brief 関数が lambdaize-loop パスによって合成された looper 関数かどうか判定する
+         * @param Function 判定対象の関数
+         * @return 合成された looper 関数か、それが呼び出す再帰用の関数であるか
+         * @note 名前はまとめられたり配置されたりすると当てにならないため、パスが付ける関数属性で判定する
+         */
+        bool isSynthesizedLooper(const llvm::Function &Function)
+        {
+            return Function.hasFnAttribute(lambdaize_attributes::LooperAttribute);
+        }
+
+        /**
+         * @brief 関数から直接呼び出される関数のうち、指定の関数属性を持つものを得る
+         * @param Caller 呼び出し元の関数
+         * @param Attribute 関数属性の名前
+         * @return 見つかった関数（なければ nullptr）
+         */
+        llvm::Function *findCalleeWith(llvm::Function &Caller, llvm::StringRef Attribute)
+        {
+            for (auto &&Inst : llvm::instructions(Caller)) {
+                if (auto *Call = llvm::dyn_cast<llvm::CallBase>(&Inst)) {
+                    auto *Callee = Call->getCalledFunction();
+                    if (Callee && Callee != &Caller && Callee->hasFnAttribute(Attribute)) {
+                        return Callee;
+                    }
+                }
+            }
+            return nullptr;
+        }
+
+        /**
+         * @brief ループが -lambdaize-batch によって extracted 関数内に作られたものかどうか判定する
+         * @param Function ループを含む関数
+         * @param Loop 判定対象のループ
+         * @return 一度の呼び出しで複数回繰り返す extracted 関数の、先頭から branch するループであるか
+         * @note その内側のループは元のプログラムのループである
+         */
+        bool isStripMinedLoop(const llvm::Function &Function, const llvm::Loop &Loop)
+        {
+            return Function.hasFnAttribute(lambdaize_attributes::BatchAttribute)
+                && Function.getEntryBlock().getSingleSuccessor() == Loop.getHeader();
+        }
+
+        /**
+         * @brief ループ内で使用されている、ループの外で定義された非グローバル変数の数を求める
+         * @note lambdaize-loop パスが extracted 関数に渡す変数の数に相当する
+         */
+        unsigned countCaptures(llvm::Loop &Loop)
+        {
+            llvm::SmallPtrSet<llvm::Value *, 16> Captures;
+            for (auto *Block : Loop.blocks()) {
+                for (auto &&Inst : *Block) {
+                    for (auto *Op : Inst.operand_values()) {
+                        if (Op->getType()->isLabelTy() || llvm::isa<llvm::Constant>(Op)) {
+                            continue;
+                        }
+                        if (auto *OpInst = llvm::dyn_cast<llvm::Instruction>(Op); OpInst && Loop.contains(OpInst)) {
+                            continue;
+                        }
+                        Captures.insert(Op);
+                    }
+                }
+            }
+            return Captures.size();
+        }
+
+        /**
+         * @brief 命令が looper 関数の呼び出しであれば、その情報を得る
+         * @param Inst 対象の命令
+         * @return looper 関数の呼び出しであればその情報
+         * @details looper.bc の looper、looper_struct、looper_parallel 関数と、
+         * @details lambdaize-loop パスが合成した looper 関数（合成された looper 関数の外からの呼び出しに限る）を対象とする
+         */
+        std::optional<LooperCall> getLooperCall(llvm::Instruction &Inst)
+        {
+            auto *Call = llvm::dyn_cast<llvm::CallBase>(&Inst);
+            auto *Callee = Call ? Call->getCalledFunction() : nullptr;
+            if (!Callee) {
+                return std::nullopt;
+            }
+            auto Name = Callee->getName();
+
+            LooperCall Result{Name, nullptr, 0, 0.};
+            bool VaList = false;
+            if (Name == "looper" || Name == "looper_struct" || Name == "looper_parallel") {
+                Result.Extracted = llvm::dyn_cast<llvm::Function>(Call->getArgOperand(0)->stripPointerCasts());
+                VaList = Name == "looper";
+                Result.Captures = VaList ? Call->arg_size() - 1 : countStructFields(Call->getArgOperand(1));
+            } else if (isSynthesizedLooper(*Callee) && !isSynthesizedLooper(*Inst.getFunction())) {
+                VaList = Callee->isVarArg();
+                Result.Captures = VaList ? Call->arg_size() : countStructFields(Call->getArgOperand(0));
+            } else {
+                return std::nullopt;
+            }
+
+            // 合成された looper 関数の種類は、再帰用の関数を呼び出すかどうかとその引数（再帰回数の有無）から判定し、
+            // extracted 関数は looper 関数もしくは再帰用の関数が呼び出すものとする
+            llvm::StringRef Kind = "runtime";
+            if (isSynthesizedLooper(*Callee)) {
+                auto *Recursive = findCalleeWith(*Callee, lambdaize_attributes::LooperAttribute);
+                Kind = !Recursive ? "while" : Recursive->arg_size() == 2 ? "recursive" : "tailrec";
+                Result.Extracted = findCalleeWith(Recursive ? *Recursive : *Callee, lambdaize_attributes::ExtractedAttribute);
+            }
+            Result.Overhead = lambdaize_cost::getOverheadPerIteration(Kind, VaList, Result.Captures, getBatch(Result.Extracted));
+            return Result;
+        }
+
+        /**
+         * @brief キャプチャ構造体のメンバの数を求める
+         * @param Captures looper 関数に渡されたキャプチャ構造体へのポインタ
+         * @return メンバの数（構造体の型が分からない場合は 0）
+         */
+        unsigned countStructFields(llvm::Value *Captures)
+        {
+            if (auto *Alloca = llvm::dyn_cast<llvm::AllocaInst>(Captures->stripPointerCasts())) {
+                if (auto *Type = llvm::dyn_cast<llvm::StructType>(Alloca->getAllocatedType())) {
+                    return Type->getNumElements();
+                }
+            }
+            return 0;
+        }
+
+        /**
+         * @brief extracted 関数が一度の呼び出しで行う繰り返しの回数を得る
+         * @param Extracted 対象の extracted 関数（分からない場合は nullptr）
+         * @return -lambdaize-batch によって strip-mining されていればその回数、そうでなければ 1
+         */
+        unsigned getBatch(const llvm::Function *Extracted)
+        {
+            unsigned Batch = 1;
+            if (Extracted && Extracted->hasFnAttribute(lambdaize_attributes::BatchAttribute)) {
+                if (Extracted->getFnAttribute(lambdaize_attributes::BatchAttribute).getValueAsString().getAsInteger(10, Batch)) {
+                    return 1;
+                }
+            }
+            return Batch;
+        }
+
+        /**
+         * @brief 指定の文字列がループメタデータに含まれるか判定する
+         * @param Loop 判定対象のループ
+         * @param Str 判定対象の文字列
+         * @return Loop のメタデータ内に Str が含まれるか
+         */
+        bool LoopContainsMetadata(const llvm::Loop &Loop, const llvm::StringRef Str)
+        {
+            if (auto *LoopID = Loop.getLoopID()) {
+                return llvm::any_of(
+                    LoopID->operands().drop_front(),
+                    [Str](const auto &MDOperand) {
+                        const auto *Metadata = llvm::dyn_cast<llvm::MDNode>(MDOperand.get());
+                        return Metadata && Metadata->getNumOperands() && Metadata->getOperand(0).equalsStr(Str);
+                    });
+            }
+            return false;
+        }
     };
 }
 
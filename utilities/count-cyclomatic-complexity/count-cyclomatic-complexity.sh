@@ -2,4 +2,4 @@
 SCRIPTDIR=$(dirname "$(realpath "$0")")
 set -x
 make --directory="$SCRIPTDIR"
-opt -load-pass-plugin "$SCRIPTDIR"/count-cyclomatic-complexity.so -passes=count-cyclomatic-complexity "$1"
+opt -load-pass-plugin "$SCRIPTDIR"/count-cyclomatic-complexity.so -passes=count-cyclomatic-complexity "$@"
@@ -0,0 +1,47 @@
+#!/bin/bash -e
+SCRIPTDIR=$(dirname "$(realpath "$0")")
+PASSDIR=$(realpath "$SCRIPTDIR/../../lambdaize-loop")
+TESTDIR=$(realpath "$SCRIPTDIR/../../test")
+TRACEDIR=
+while getopts t: OPT
+do
+    case $OPT in
+        "t" ) TRACEDIR=$(realpath "$OPTARG") ;;
+         *  ) echo "usage: $0 [-t TRACEDIR] [FUNCTIONS,LOOPS,DEPTH,CAPTURES,BLOCKS...]"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    set -- 1,1,1,8,8 16,4,2,8,8 64,8,4,16,8 16,4,16,16,8 64,8,4,64,32
+fi
+
+make --directory="$SCRIPTDIR" --no-print-directory >&2
+make --directory="$PASSDIR" --no-print-directory >&2
+make --directory="$TESTDIR" --no-print-directory measure >&2
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+[ -z "$TRACEDIR" ] || mkdir -p "$TRACEDIR"
+
+printf '%9s %5s %5s %8s %6s %12s %10s %10s %12s\n' \
+       functions loops depth captures blocks instructions pass[s] total[s] peak_rss[KiB]
+for SPEC in "$@"; do
+    IFS=, read -r FUNCTIONS LOOPS DEPTH CAPTURES BLOCKS <<< "$SPEC"
+    "$SCRIPTDIR/generate-ir" -f "$FUNCTIONS" -l "$LOOPS" -d "$DEPTH" -c "$CAPTURES" -b "$BLOCKS" > "$WORKDIR/input.ll"
+    INSTRUCTIONS=$(grep -c '^  ' "$WORKDIR/input.ll")
+
+    TRACEFLAGS=()
+    if [ -n "$TRACEDIR" ]; then
+        TRACEFLAGS=(-time-trace -time-trace-file="$TRACEDIR/${SPEC//,/-}.json")
+    fi
+
+    # パスの実行時間は -time-passes の出力のうち LambdaizeLoop の行の Wall Time を用いる
+    read -r TOTAL RSS < <("$TESTDIR/measure" "$(command -v opt)" -disable-output -time-passes "${TRACEFLAGS[@]}" \
+                          -load-pass-plugin "$PASSDIR/lambdaize-loop.so" -passes=lambdaize-loop $OPTFLAGS \
+                          "$WORKDIR/input.ll" 2> "$WORKDIR/timing.txt")
+    PASS=$(awk '/LambdaizeLoop/ {
+                    for (i = 1; i <= NF; ++i) if ($i ~ /^[0-9.]+$/ && $(i + 1) ~ /^\(/) wall = $i
+                    print wall; exit
+                }' "$WORKDIR/timing.txt")
+    printf '%9d %5d %5d %8d %6d %12d %10.4f %10.4f %12d\n' \
+           "$FUNCTIONS" "$LOOPS" "$DEPTH" "$CAPTURES" "$BLOCKS" "$INSTRUCTIONS" "${PASS:-0}" "$TOTAL" "$RSS"
+done
@@ -0,0 +1,181 @@
+/**
+ * @file generate-ir.cpp
+ * @brief lambdaize-loop パスのコンパイル時間を計測するための IR を生成する
+ * @details 関数の数、関数あたりのループの数、ループのネストの深さ、ループあたりのキャプチャされる変数の数を指定して、
+ * @details lambdaizeloop メタデータ付きのループを含む IR モジュールを標準出力に書き出す
+ * @details 生成される IR は clang -O0 の出力と同様に、ループ変数をスタック上に確保する
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+namespace {
+    /**
+     * @brief 生成する IR の大きさ
+     */
+    struct GeneratorConfig {
+        unsigned Functions = 1; ///< 関数の数
+        unsigned Loops = 1;     ///< 関数あたりの最も外側のループの数
+        unsigned Depth = 1;     ///< ループのネストの深さ
+        unsigned Captures = 1;  ///< ループあたりのキャプチャされる変数の数
+        unsigned Blocks = 1;    ///< ループ本体あたりの条件分岐の数
+    };
+
+    /**
+     * @brief IR の生成器
+     */
+    class Generator {
+    public:
+        explicit Generator(const GeneratorConfig &Config, std::ostream &Out)
+            : Config(Config), Out(Out)
+        {
+        }
+
+        /**
+         * @brief モジュール全体を生成する
+         */
+        void generateModule()
+        {
+            for (unsigned Function = 0; Function < Config.Functions; ++Function) {
+                generateFunction(Function);
+            }
+            Out << "!0 = !{!\"lambdaizeloop\"}\n";
+            for (unsigned ID = 1; ID < NextMetadata; ++ID) {
+                Out << '!' << ID << " = distinct !{!" << ID << ", !0}\n";
+            }
+        }
+
+    private:
+        const GeneratorConfig &Config;
+        std::ostream &Out;
+        unsigned NextValue = 0;    ///< 次に使う値の番号
+        unsigned NextLabel = 0;    ///< 次に使うラベルの番号
+        unsigned NextMetadata = 1; ///< 次に使うループメタデータの番号
+
+        std::string value() { return "%v" + std::to_string(NextValue++); }
+        std::string label() { return "l" + std::to_string(NextLabel++); }
+
+        /**
+         * @brief 関数を一つ生成する
+         * @param Index 関数の番号
+         */
+        void generateFunction(unsigned Index)
+        {
+            Out << "define void @f" << Index << "(ptr %p, i32 %n) {\n";
+            Out << "entry:\n";
+
+            // ループ変数はネストの深さごとに一つずつ確保する
+            for (unsigned Level = 0; Level < Config.Depth; ++Level) {
+                Out << "  %i" << Level << " = alloca i32\n";
+            }
+
+            // ループの外で定義され、ループ内で使用される変数を用意する
+            for (unsigned Capture = 0; Capture < Config.Captures; ++Capture) {
+                Out << "  %c" << Capture << " = add i32 %n, " << Capture << '\n';
+            }
+
+            // 各ループの exit ブロックは次のループの preheader を兼ねる
+            auto Current = label();
+            Out << "  br label %" << Current << '\n';
+            for (unsigned Loop = 0; Loop < Config.Loops; ++Loop) {
+                Current = generateLoop(Current, 0);
+            }
+            Out << Current << ":\n";
+            Out << "  ret void\n";
+            Out << "}\n\n";
+        }
+
+        /**
+         * @brief ループを一つ生成する
+         * @param Preheader ループの preheader となるブロックのラベル
+         * @param Level ループのネストの深さ
+         * @return ループの exit ブロックのラベル（ブロックの中身は呼び出し元が生成する）
+         */
+        std::string generateLoop(const std::string &Preheader, unsigned Level)
+        {
+            auto Header = label(), Body = label(), Latch = label(), Exit = label();
+            auto IV = "%i" + std::to_string(Level);
+
+            Out << Preheader << ":\n";
+            Out << "  store i32 0, ptr " << IV << '\n';
+            Out << "  br label %" << Header << '\n';
+
+            Out << Header << ":\n";
+            auto Count = value(), Cond = value();
+            Out << "  " << Count << " = load i32, ptr " << IV << '\n';
+            Out << "  " << Cond << " = icmp slt i32 " << Count << ", %n\n";
+            Out << "  br i1 " << Cond << ", label %" << Body << ", label %" << Exit << '\n';
+
+            // キャプチャされた変数はすべてループ本体の先頭で使用する
+            Out << Body << ":\n";
+            for (unsigned Capture = 0; Capture < Config.Captures; ++Capture) {
+                Out << "  store i32 %c" << Capture << ", ptr %p\n";
+            }
+
+            // 条件分岐を並べてループ本体のブロック数を増やす
+            for (unsigned Block = 0; Block < Config.Blocks; ++Block) {
+                auto Then = label(), Next = label();
+                auto Loaded = value(), Added = value(), Test = value();
+                Out << "  " << Loaded << " = load i32, ptr %p\n";
+                Out << "  " << Added << " = add i32 " << Loaded << ", " << Count << '\n';
+                Out << "  store i32 " << Added << ", ptr %p\n";
+                Out << "  " << Test << " = icmp eq i32 " << Added << ", " << Block << '\n';
+                Out << "  br i1 " << Test << ", label %" << Then << ", label %" << Next << '\n';
+                Out << Then << ":\n";
+                if (Config.Captures) {
+                    Out << "  store i32 %c" << (Block + Level) % Config.Captures << ", ptr %p\n";
+                }
+                Out << "  br label %" << Next << '\n';
+                Out << Next << ":\n";
+            }
+
+            // 内側のループは本体の後ろに置く
+            if (Level + 1 < Config.Depth) {
+                auto Inner = label();
+                Out << "  br label %" << Inner << '\n';
+                Out << generateLoop(Inner, Level + 1) << ":\n";
+            }
+            Out << "  br label %" << Latch << '\n';
+
+            Out << Latch << ":\n";
+            auto Reloaded = value(), Incremented = value();
+            Out << "  " << Reloaded << " = load i32, ptr " << IV << '\n';
+            Out << "  " << Incremented << " = add i32 " << Reloaded << ", 1\n";
+            Out << "  store i32 " << Incremented << ", ptr " << IV << '\n';
+            Out << "  br label %" << Header << ", !llvm.loop !" << NextMetadata++ << '\n';
+            return Exit;
+        }
+    };
+}
+
+int main(int argc, char *argv[])
+{
+    GeneratorConfig Config;
+    int Option;
+    while ((Option = getopt(argc, argv, "f:l:d:c:b:")) != -1) {
+        switch (Option) {
+        case 'f':
+            Config.Functions = std::atoi(optarg);
+            break;
+        case 'l':
+            Config.Loops = std::atoi(optarg);
+            break;
+        case 'd':
+            Config.Depth = std::atoi(optarg);
+            break;
+        case 'c':
+            Config.Captures = std::atoi(optarg);
+            break;
+        case 'b':
+            Config.Blocks = std::atoi(optarg);
+            break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [-f FUNCTIONS] [-l LOOPS] [-d DEPTH] [-c CAPTURES] [-b BLOCKS]\n";
+            return 1;
+        }
+    }
+    Generator(Config, std::cout).generateModule();
+    return 0;
+}
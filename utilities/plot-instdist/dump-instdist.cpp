@@ -0,0 +1,424 @@
+/**
+ * @file dump-instdist.cpp
+ * @brief 実行ファイルに含まれる機械語命令の出現分布を求める
+ * @details LLVM の MC 逆アセンブラで各ファイルのテキストセクションを直接デコードし、ニーモニックごとの出現回数を数える
+ * @details テキストセクションは関数シンボルの境界で分割し、複数のファイル・複数の範囲を並列にデコードする
+ * @details シンボル名の正規表現を指定すると、名前が一致する関数（extracted 関数や looper 関数など）だけを対象にする
+ */
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/MC/MCAsmInfo.h>
+#include <llvm/MC/MCContext.h>
+#include <llvm/MC/MCDisassembler/MCDisassembler.h>
+#include <llvm/MC/MCInst.h>
+#include <llvm/MC/MCInstPrinter.h>
+#include <llvm/MC/MCInstrInfo.h>
+#include <llvm/MC/MCRegisterInfo.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/MC/MCTargetOptions.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Object/ELFObjectFile.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Regex.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+    /**
+     * @brief 出力の形式
+     */
+    enum class Format {
+        CSV,  ///< 命令ごとに各ファイルでの割合 [%] を並べた CSV（plot.gpi が読み込む）
+        JSON, ///< ファイルごとの命令数と命令ごとの出現回数
+    };
+
+    /**
+     * @brief 一つのスレッドでまとめてデコードするテキストセクションの大きさの目安
+     */
+    constexpr std::uint64_t ChunkSize = 1 << 20;
+
+    /**
+     * @brief デコードするバイト列の範囲
+     */
+    struct Range {
+        std::size_t File;                   ///< 範囲を含むファイルの番号
+        std::uint64_t Address;              ///< 範囲の先頭のアドレス
+        llvm::ArrayRef<std::uint8_t> Bytes; ///< 範囲のバイト列
+    };
+
+    /**
+     * @brief 一つのファイルを逆アセンブルするための MC のオブジェクト一式
+     * @note MCContext はスレッド間で共有できないため、スレッドごと・ファイルごとに作る
+     */
+    class Disassembler {
+    public:
+        /**
+         * @brief Object のターゲットの逆アセンブラを作る
+         * @param Object 逆アセンブルするファイル
+         * @param[out] Error 作れなかった場合の理由
+         */
+        Disassembler(const llvm::object::ObjectFile &Object, std::string &Error)
+        {
+            auto Triple = Object.makeTriple();
+            auto *Target = llvm::TargetRegistry::lookupTarget(Triple.getTriple(), Error);
+            if (!Target) {
+                return;
+            }
+            std::string Features;
+            if (auto SubtargetFeatures = llvm::expectedToOptional(Object.getFeatures())) {
+                Features = SubtargetFeatures->getString();
+            }
+            MRI.reset(Target->createMCRegInfo(Triple.getTriple()));
+            MAI.reset(Target->createMCAsmInfo(*MRI, Triple.getTriple(), Options));
+            STI.reset(Target->createMCSubtargetInfo(Triple.getTriple(), "", Features));
+            MII.reset(Target->createMCInstrInfo());
+            if (!MRI || !MAI || !STI || !MII) {
+                Error = "no MC support for " + Triple.getTriple();
+                return;
+            }
+            Context = std::make_unique<llvm::MCContext>(Triple, MAI.get(), MRI.get(), STI.get());
+            DisAsm.reset(Target->createMCDisassembler(*STI, *Context));
+            Printer.reset(Target->createMCInstPrinter(Triple, MAI->getAssemblerDialect(), *MAI, *MII, *MRI));
+            if (!DisAsm || !Printer) {
+                Error = "no disassembler for " + Triple.getTriple();
+            }
+        }
+
+        explicit operator bool() const { return DisAsm && Printer; }
+
+        /**
+         * @brief 範囲をデコードし、ニーモニックごとの出現回数を Counts に加える
+         * @note デコードできなかったバイトは objdump と同様に "(bad)" として数え、1 バイト進める
+         */
+        void count(const Range &Range, llvm::StringMap<std::uint64_t> &Counts)
+        {
+            llvm::MCInst Inst;
+            std::uint64_t Size;
+            for (std::uint64_t Offset = 0; Offset < Range.Bytes.size(); Offset += Size ? Size : 1) {
+                auto Status = DisAsm->getInstruction(Inst, Size, Range.Bytes.slice(Offset), Range.Address + Offset,
+                                                     llvm::nulls());
+                if (Status != llvm::MCDisassembler::Success) {
+                    ++Counts["(bad)"];
+                    Size = 1;
+                    continue;
+                }
+                ++Counts[getMnemonic(Inst, Range.Address + Offset)];
+            }
+        }
+
+    private:
+        llvm::MCTargetOptions Options;
+        std::unique_ptr<const llvm::MCRegisterInfo> MRI;
+        std::unique_ptr<const llvm::MCAsmInfo> MAI;
+        std::unique_ptr<const llvm::MCSubtargetInfo> STI;
+        std::unique_ptr<const llvm::MCInstrInfo> MII;
+        std::unique_ptr<llvm::MCContext> Context;
+        std::unique_ptr<const llvm::MCDisassembler> DisAsm;
+        std::unique_ptr<llvm::MCInstPrinter> Printer;
+        std::string Buffer;
+
+        /**
+         * @brief 命令のニーモニックを得る
+         * @details objdump の出力の最初の列と同様に、表示される命令の最初の単語を用いる
+         * @note MCInstPrinter::getMnemonic は条件分岐の条件などを含まないため、命令全体を表示してから取り出す
+         */
+        llvm::StringRef getMnemonic(const llvm::MCInst &Inst, std::uint64_t Address)
+        {
+            Buffer.clear();
+            llvm::raw_string_ostream OS(Buffer);
+            Printer->printInst(&Inst, Address, "", *STI, OS);
+            OS.flush();
+            return llvm::StringRef(Buffer).ltrim().take_until([](char C) { return C == ' ' || C == '\t'; });
+        }
+    };
+
+    /**
+     * @brief 関数シンボルの範囲
+     */
+    struct Symbol {
+        std::uint64_t Address;
+        std::uint64_t Size; ///< 大きさ（不明な場合は 0）
+        bool Selected;      ///< 解析の対象か
+    };
+
+    /**
+     * @brief ファイルのテキストセクションをデコードする範囲に分ける
+     * @param Index ファイルの番号
+     * @param Object ファイル
+     * @param Filter 対象とする関数の名前の正規表現（全体を対象とする場合は nullptr）
+     * @param[out] Ranges 範囲の追加先
+     * @details Filter を指定しない場合はテキストセクション全体を関数シンボルの境界で ChunkSize 程度ずつに分ける
+     * @details Filter を指定した場合は名前が一致する関数ごとに一つの範囲とする
+     */
+    void collectRanges(std::size_t Index, const llvm::object::ObjectFile &Object, const llvm::Regex *Filter,
+                       std::vector<Range> &Ranges)
+    {
+        for (auto &&Section : Object.sections()) {
+            if (!Section.isText() || Section.isVirtual()) {
+                continue;
+            }
+            auto Contents = Section.getContents();
+            if (!Contents) {
+                llvm::consumeError(Contents.takeError());
+                continue;
+            }
+            auto Bytes = llvm::arrayRefFromStringRef(*Contents);
+            auto Begin = Section.getAddress(), End = Begin + Bytes.size();
+
+            std::vector<Symbol> Symbols;
+            for (auto &&ObjectSymbol : Object.symbols()) {
+                // 読み取れないシンボルは無視する
+                auto Type = llvm::expectedToOptional(ObjectSymbol.getType());
+                auto SymbolSection = llvm::expectedToOptional(ObjectSymbol.getSection());
+                auto Address = llvm::expectedToOptional(ObjectSymbol.getAddress());
+                if (!Type || !SymbolSection || !Address || *Type != llvm::object::SymbolRef::ST_Function ||
+                    *SymbolSection != Section || *Address < Begin || *Address >= End) {
+                    continue;
+                }
+                std::uint64_t Size = 0;
+                if (llvm::isa<llvm::object::ELFObjectFileBase>(&Object)) {
+                    Size = llvm::object::ELFSymbolRef(ObjectSymbol).getSize();
+                }
+                bool Selected = true;
+                if (Filter) {
+                    auto Name = llvm::expectedToOptional(ObjectSymbol.getName());
+                    Selected = Name && Filter->match(*Name);
+                }
+                Symbols.push_back({*Address, Size, Selected});
+            }
+            std::sort(Symbols.begin(), Symbols.end(),
+                      [](const Symbol &S1, const Symbol &S2) { return S1.Address < S2.Address; });
+
+            auto add = [&](std::uint64_t From, std::uint64_t To) {
+                if (From < To) {
+                    Ranges.push_back({Index, From, Bytes.slice(From - Begin, To - From)});
+                }
+            };
+
+            if (!Filter) {
+                auto ChunkBegin = Begin;
+                for (auto &&Symbol : Symbols) {
+                    if (Symbol.Address - ChunkBegin >= ChunkSize) {
+                        add(ChunkBegin, Symbol.Address);
+                        ChunkBegin = Symbol.Address;
+                    }
+                }
+                add(ChunkBegin, End);
+                continue;
+            }
+
+            // 大きさの分からない関数は次のシンボルの手前まで続くものとする
+            for (std::size_t I = 0; I < Symbols.size(); ++I) {
+                if (!Symbols[I].Selected || (I > 0 && Symbols[I - 1].Address == Symbols[I].Address)) {
+                    continue;
+                }
+                auto Next = I + 1 < Symbols.size() ? Symbols[I + 1].Address : End;
+                auto To = Symbols[I].Size ? std::min(Symbols[I].Address + Symbols[I].Size, End) : Next;
+                add(Symbols[I].Address, To);
+            }
+        }
+    }
+
+    /**
+     * @brief 命令の並べ方を求める
+     * @details plot-instdist.sh がこれまで用いていた順序と同じく、最初のファイルでの割合と二番目のファイルでの割合の比の昇順に並べる
+     * @details 二番目のファイルに現れない命令は最後に、最初のファイルでの割合の昇順に並べる
+     */
+    std::vector<std::string> sortInstructions(const std::vector<llvm::StringMap<std::uint64_t>> &Counts,
+                                              const std::vector<std::uint64_t> &Totals)
+    {
+        llvm::StringMap<bool> Set;
+        for (auto &&FileCounts : Counts) {
+            for (auto &&Entry : FileCounts) {
+                Set[Entry.getKey()] = true;
+            }
+        }
+        std::vector<std::string> Instructions;
+        for (auto &&Entry : Set) {
+            Instructions.push_back(Entry.getKey().str());
+        }
+
+        auto ratio = [&](std::size_t File, const std::string &Instruction) {
+            if (File >= Counts.size() || !Totals[File]) {
+                return 0.;
+            }
+            return double(Counts[File].lookup(Instruction)) / double(Totals[File]);
+        };
+        std::sort(Instructions.begin(), Instructions.end(), [&](const std::string &I1, const std::string &I2) {
+            auto C11 = ratio(0, I1), C12 = ratio(0, I2);
+            auto C21 = ratio(1, I1), C22 = ratio(1, I2);
+            if (C21 != 0 && C22 != 0) {
+                auto Ratio1 = C11 / C21, Ratio2 = C12 / C22;
+                return Ratio1 != Ratio2 ? Ratio1 < Ratio2 : I1 < I2;
+            }
+            if (C21 != 0 || C22 != 0) {
+                return C21 != 0;
+            }
+            return C11 != C12 ? C11 < C12 : I1 < I2;
+        });
+        return Instructions;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    auto OutputFormat = Format::CSV;
+    const char *Pattern = nullptr;
+    unsigned Jobs = std::thread::hardware_concurrency();
+    int Option;
+    while ((Option = getopt(argc, argv, "f:s:j:")) != -1) {
+        switch (Option) {
+        case 'f':
+            if (llvm::StringRef(optarg) == "csv") {
+                OutputFormat = Format::CSV;
+                break;
+            }
+            if (llvm::StringRef(optarg) == "json") {
+                OutputFormat = Format::JSON;
+                break;
+            }
+            [[fallthrough]];
+        default:
+            llvm::errs() << "usage: " << argv[0] << " [-f csv|json] [-s SYMBOL_REGEX] [-j JOBS] EXE_FILE...\n";
+            return 1;
+        case 's':
+            Pattern = optarg;
+            break;
+        case 'j':
+            Jobs = std::atoi(optarg);
+            break;
+        }
+    }
+    if (optind == argc) {
+        llvm::errs() << "usage: " << argv[0] << " [-f csv|json] [-s SYMBOL_REGEX] [-j JOBS] EXE_FILE...\n";
+        return 1;
+    }
+    Jobs = std::max(Jobs, 1u);
+
+    std::unique_ptr<llvm::Regex> Filter;
+    if (Pattern) {
+        Filter = std::make_unique<llvm::Regex>(Pattern);
+        std::string Error;
+        if (!Filter->isValid(Error)) {
+            llvm::errs() << argv[0] << ": invalid symbol regex: " << Error << '\n';
+            return 1;
+        }
+    }
+
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllDisassemblers();
+
+    std::vector<std::string> Paths(argv + optind, argv + argc);
+    std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> Objects;
+    std::vector<Range> Ranges;
+    for (auto &&Path : Paths) {
+        auto Object = llvm::object::ObjectFile::createObjectFile(Path);
+        if (!Object) {
+            llvm::errs() << argv[0] << ": " << Path << ": " << llvm::toString(Object.takeError()) << '\n';
+            return 1;
+        }
+        std::string Error;
+        if (!Disassembler(*Object->getBinary(), Error)) {
+            llvm::errs() << argv[0] << ": " << Path << ": " << Error << '\n';
+            return 1;
+        }
+        collectRanges(Objects.size(), *Object->getBinary(), Filter.get(), Ranges);
+        Objects.push_back(std::move(*Object));
+    }
+
+    // 大きい範囲から順に取り出すことで、最後に一つのスレッドだけが残る時間を短くする
+    std::sort(Ranges.begin(), Ranges.end(),
+              [](const Range &R1, const Range &R2) { return R1.Bytes.size() > R2.Bytes.size(); });
+
+    // スレッドごとにファイルごとの出現回数を数え、最後に合計する
+    std::vector<std::vector<llvm::StringMap<std::uint64_t>>> ThreadCounts(
+        Jobs, std::vector<llvm::StringMap<std::uint64_t>>(Paths.size()));
+    std::atomic<std::size_t> Next{0};
+    auto work = [&](unsigned Thread) {
+        std::vector<std::unique_ptr<Disassembler>> Disassemblers(Paths.size());
+        for (std::size_t I; (I = Next++) < Ranges.size();) {
+            auto &Range = Ranges[I];
+            auto &Disasm = Disassemblers[Range.File];
+            if (!Disasm) {
+                std::string Error;
+                Disasm = std::make_unique<Disassembler>(*Objects[Range.File].getBinary(), Error);
+            }
+            Disasm->count(Range, ThreadCounts[Thread][Range.File]);
+        }
+    };
+    std::vector<std::thread> Threads;
+    for (unsigned Thread = 1; Thread < Jobs; ++Thread) {
+        Threads.emplace_back(work, Thread);
+    }
+    work(0);
+    for (auto &&Thread : Threads) {
+        Thread.join();
+    }
+
+    std::vector<llvm::StringMap<std::uint64_t>> Counts(Paths.size());
+    std::vector<std::uint64_t> Totals(Paths.size());
+    for (auto &&PerThread : ThreadCounts) {
+        for (std::size_t File = 0; File < Paths.size(); ++File) {
+            for (auto &&Entry : PerThread[File]) {
+                Counts[File][Entry.getKey()] += Entry.getValue();
+                Totals[File] += Entry.getValue();
+            }
+        }
+    }
+
+    auto Instructions = sortInstructions(Counts, Totals);
+    auto &OS = llvm::outs();
+    if (OutputFormat == Format::JSON) {
+        llvm::json::OStream J(OS, 2);
+        J.object([&] {
+            if (Pattern) {
+                J.attribute("symbols", Pattern);
+            }
+            J.attributeArray("files", [&] {
+                for (std::size_t File = 0; File < Paths.size(); ++File) {
+                    J.object([&] {
+                        J.attribute("file", Paths[File]);
+                        J.attribute("instructions", static_cast<int64_t>(Totals[File]));
+                        J.attributeObject("counts", [&] {
+                            for (auto &&Instruction : Instructions) {
+                                if (auto Count = Counts[File].lookup(Instruction)) {
+                                    J.attribute(Instruction, static_cast<int64_t>(Count));
+                                }
+                            }
+                        });
+                    });
+                }
+            });
+        });
+        OS << '\n';
+        return 0;
+    }
+
+    OS << "instruction";
+    for (auto &&Path : Paths) {
+        OS << ',' << llvm::sys::path::filename(Path);
+    }
+    OS << '\n';
+    for (auto &&Instruction : Instructions) {
+        OS << Instruction;
+        for (std::size_t File = 0; File < Paths.size(); ++File) {
+            auto Percentage = Totals[File] ? Counts[File].lookup(Instruction) * 100. / Totals[File] : 0.;
+            OS << ',' << llvm::format("%f", Percentage);
+        }
+        OS << '\n';
+    }
+    return 0;
+}
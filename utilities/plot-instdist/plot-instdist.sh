@@ -1,19 +1,23 @@
-#!/bin/bash
+#!/bin/bash -e
 
 SCRIPTDIR=$(dirname "$(realpath "$0")")
+OPTIONS=()
+while getopts s:j: OPT
+do
+    case $OPT in
+        "s" ) OPTIONS+=(-s "$OPTARG") ;;
+        "j" ) OPTIONS+=(-j "$OPTARG") ;;
+         *  ) echo "usage: $0 [-s SYMBOL_REGEX] [-j JOBS] EXE_FILE..."; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-s SYMBOL_REGEX] [-j JOBS] EXE_FILE..."
+    exit 1
+fi
 
-function dump_instruction_counts() {
-    objdump --disassemble --no-show-raw-insn "$1" |
-    grep '^ '                                     |
-    cut --fields=2                                |
-    cut --delimiter=' ' --fields=1                |
-    sort                                          |
-    uniq --count
-}
-
-awk --assign filename1="$(basename "$1")"   \
-    --assign filename2="$(basename "$2")"   \
-    --file "$SCRIPTDIR"/dump-instdist.awk \
-    <(dump_instruction_counts "$1")       \
-    <(dump_instruction_counts "$2")       |
-gnuplot --persist -e "$(tr '\n' ';' < "$SCRIPTDIR"/plot.gpi)"
+make --directory="$SCRIPTDIR" --no-print-directory >&2
+DATAFILE=$(mktemp)
+trap 'rm -f "$DATAFILE"' EXIT
+"$SCRIPTDIR"/dump-instdist "${OPTIONS[@]}" "$@" > "$DATAFILE"
+gnuplot --persist -e "datafile = '$DATAFILE'; columns = $(($# + 1))" "$SCRIPTDIR"/plot.gpi